@@ -0,0 +1,457 @@
+#ifndef __ARRAY_C__
+#define __ARRAY_C__
+
+#include "core.c"
+
+// Numeric arrays (see ARRAY_INTS in mem.c). The bulk operations below
+// never box elements: they are simple loops over restrict pointers, which
+// the compiler vectorizes (gcc does so at -O2 since version 12, or at -O3).
+// Integer arithmetic wraps around like unsigned arithmetic.
+
+static inline int is_array(obj *o) {
+    return obj_type(o) == TYPE_INT_ARRAY || obj_type(o) == TYPE_REAL_ARRAY;
+}
+
+// The type of the elements of an array of the given type.
+static inline native_type array_element_type(native_type type) {
+    return (type == TYPE_INT_ARRAY)? TYPE_INTEGER : TYPE_REAL;
+}
+
+static inline void array_assert(obj *o) {
+    if (!is_array(o)) {
+        lisp_error("Type error (expected array, found %d)!", obj_type(o));
+    }
+}
+
+static obj *new_array(native_type type, size_t n) {
+    if (n > OBJ_LEN_MAX/8) {
+        lisp_error("Array length %zu too large", n);
+    }
+    return new_obj(type, 0, n*8);
+}
+
+// ( array i -- array i )
+static size_t array_index(void) {
+    array_assert(NOS);
+    obj_assert_type(TOS, TYPE_INTEGER);
+    if (integer_value(TOS) < 0 ||
+        (uint64_t)integer_value(TOS) >= ARRAY_LEN(NOS))
+    {
+        lisp_error("Array index %" PRId64 " out of range (length %zu)",
+                integer_value(TOS), ARRAY_LEN(NOS));
+    }
+    return integer_value(TOS);
+}
+
+// ( n x -- array )
+// An array of n copies of the integer or real x.
+static void core_make_array(void) {
+    obj_assert_type(NOS, TYPE_INTEGER);
+    if (integer_value(NOS) < 0) {
+        lisp_error("Negative array length %" PRId64, integer_value(NOS));
+    }
+    if ((uint64_t)integer_value(NOS) > OBJ_LEN_MAX/8) {
+        lisp_error("Array length %" PRId64 " too large", integer_value(NOS));
+    }
+    const size_t n = integer_value(NOS);
+    size_t i;
+    if (obj_type(TOS) == TYPE_INTEGER) {
+        const int64_t x = integer_value(TOS);
+        NOS = new_array(TYPE_INT_ARRAY, n);
+        int64_t *restrict r = ARRAY_INTS(NOS);
+        for (i=0; i<n; i++) r[i] = x;
+    } else if (obj_type(TOS) == TYPE_REAL) {
+        const double x = real_value(TOS);
+        NOS = new_array(TYPE_REAL_ARRAY, n);
+        double *restrict r = ARRAY_REALS(NOS);
+        for (i=0; i<n; i++) r[i] = x;
+    } else {
+        lisp_error("Trying to fill an array with type %d", obj_type(TOS));
+    }
+    core_drop();
+}
+
+// ( list -- array )
+// The elements must be either all integers or all reals.
+static void core_list_array(void) {
+    native_type type = (TOS == NIL || obj_type(TOS) != TYPE_CONS)?
+        TYPE_INTEGER : obj_type(HEAD(TOS));
+    size_t i, n = 0;
+    obj *l;
+    for (l=TOS; obj_type(l) == TYPE_CONS; l=TAIL(l), n++) {
+        if (obj_type(HEAD(l)) != type ||
+            (type != TYPE_INTEGER && type != TYPE_REAL))
+        {
+            lisp_error("Trying to make an array of type %d",
+                    obj_type(HEAD(l)));
+        }
+    }
+    if (l != NIL) {
+        lisp_error("Trying to convert an improper list to an array");
+    }
+    if (type == TYPE_INTEGER) {
+        obj *o = new_array(TYPE_INT_ARRAY, n);
+        for (i=0, l=TOS; i<n; i++, l=TAIL(l))
+            ARRAY_INTS(o)[i] = integer_value(HEAD(l));
+        TOS = o;
+    } else {
+        obj *o = new_array(TYPE_REAL_ARRAY, n);
+        for (i=0, l=TOS; i<n; i++, l=TAIL(l))
+            ARRAY_REALS(o)[i] = real_value(HEAD(l));
+        TOS = o;
+    }
+}
+
+// ( array i -- x )
+static void array_box(size_t i) {
+    if (obj_type(NOS) == TYPE_INT_ARRAY)
+        TOS = new_integer(ARRAY_INTS(NOS)[i]);
+    else
+        TOS = new_real(ARRAY_REALS(NOS)[i]);
+}
+
+// ( array -- list )
+static void core_array_list(void) {
+    array_assert(TOS);
+    size_t i = ARRAY_LEN(TOS);
+    push(NIL);
+    while (i > 0) {
+        push(NOS);
+        push(NIL);
+        array_box(--i);         // array list array x
+        core_nip();
+        core_swap();
+        core_cons();
+    }
+    core_nip();
+}
+
+// ( array -- n )
+static void core_array_length(void) {
+    array_assert(TOS);
+    TOS = new_integer(ARRAY_LEN(TOS));
+}
+
+// ( array i -- x )
+static void core_array_ref(void) {
+    array_box(array_index());
+    core_nip();
+}
+
+// ( array i x -- array )
+static void core_array_set(void) {
+    core_rot();
+    core_rot();                 // x array i
+    const size_t i = array_index();
+    const native_type type = array_element_type(obj_type(NOS));
+    obj_assert_type(NNOS, type);
+    if (type == TYPE_INTEGER)
+        ARRAY_INTS(NOS)[i] = integer_value(NNOS);
+    else
+        ARRAY_REALS(NOS)[i] = real_value(NNOS);
+    core_drop();
+    core_nip();
+}
+
+// Element-wise operations, for two arrays (aa), an array and a scalar (as)
+// and a scalar and an array (sa). T is the type of the operands and R the
+// type of the result.
+#define ARRAY_OP(name, T, R, expr) \
+static void name##_aa(R *restrict r, const T *restrict a, \
+                      const T *restrict b, size_t n) { \
+    size_t i; \
+    for (i=0; i<n; i++) { const T x = a[i], y = b[i]; r[i] = (expr); } \
+} \
+static void name##_as(R *restrict r, const T *restrict a, const T y, \
+                      size_t n) { \
+    size_t i; \
+    for (i=0; i<n; i++) { const T x = a[i]; r[i] = (expr); } \
+} \
+static void name##_sa(R *restrict r, const T x, const T *restrict b, \
+                      size_t n) { \
+    size_t i; \
+    for (i=0; i<n; i++) { const T y = b[i]; r[i] = (expr); } \
+}
+
+ARRAY_OP(add_i, int64_t, int64_t, (int64_t)((uint64_t)x + (uint64_t)y))
+ARRAY_OP(add_r, double, double, x + y)
+ARRAY_OP(mul_i, int64_t, int64_t, (int64_t)((uint64_t)x * (uint64_t)y))
+ARRAY_OP(mul_r, double, double, x * y)
+ARRAY_OP(div_i, int64_t, int64_t, x / y)
+ARRAY_OP(div_r, double, double, x / y)
+ARRAY_OP(lt_i, int64_t, int64_t, x < y)
+ARRAY_OP(lt_r, double, int64_t, x < y)
+
+#undef ARRAY_OP
+
+enum { ARRAY_ADD, ARRAY_MUL, ARRAY_DIV, ARRAY_LT };
+
+// Call the element-wise operation name for the operands a and b, with the
+// result in r. ELEMS and VALUE give the elements of an operand which is an
+// array, or the value of a scalar.
+#define ARRAY_APPLY(name, r, a, b, n, ELEMS, VALUE) \
+    do { \
+        if (is_array(a) && is_array(b)) \
+            name##_aa(r, ELEMS(a), ELEMS(b), n); \
+        else if (is_array(a)) \
+            name##_as(r, ELEMS(a), VALUE(b), n); \
+        else \
+            name##_sa(r, VALUE(a), ELEMS(b), n); \
+    } while (0)
+
+// ( a b -- c )
+// At least one of a and b is an array, the other one is either an array of
+// the same type and length, or a number of the element type.
+static void core_array_op(int op) {
+    static const char *names[] = {"add", "multiply", "divide", "compare"};
+    native_type type = TYPE_INT_ARRAY;
+    size_t n = 0, i;
+    if (is_array(NOS) && (obj_type(TOS) == obj_type(NOS) ||
+        obj_type(TOS) == array_element_type(obj_type(NOS))))
+    {
+        type = obj_type(NOS);
+        n = ARRAY_LEN(NOS);
+        if (is_array(TOS) && ARRAY_LEN(TOS) != n) {
+            lisp_error("Trying to %s arrays of lengths %zu and %zu",
+                    names[op], n, ARRAY_LEN(TOS));
+        }
+    } else if (is_array(TOS) &&
+               obj_type(NOS) == array_element_type(obj_type(TOS)))
+    {
+        type = obj_type(TOS);
+        n = ARRAY_LEN(TOS);
+    } else {
+        lisp_error("Trying to %s types %d and %d element-wise",
+                names[op], obj_type(NOS), obj_type(TOS));
+    }
+
+    if (op == ARRAY_DIV && type == TYPE_INT_ARRAY) {
+        const int64_t *b = is_array(TOS)? ARRAY_INTS(TOS) : NULL;
+        const int64_t *a = is_array(NOS)? ARRAY_INTS(NOS) : NULL;
+        for (i=0; i<n; i++) {
+            const int64_t x = a? a[i] : integer_value(NOS);
+            const int64_t y = b? b[i] : integer_value(TOS);
+            if (y == 0 || (x == INT64_MIN && y == -1)) {
+                lisp_error("Integer division error (%" PRId64 "/%" PRId64
+                        ")", x, y);
+            }
+        }
+    }
+
+    obj *r = new_array((op == ARRAY_LT)? TYPE_INT_ARRAY : type, n);
+    obj *a = NOS, *b = TOS;
+    if (type == TYPE_INT_ARRAY) {
+        int64_t *x = ARRAY_INTS(r);
+        switch (op) {
+            case ARRAY_ADD:
+                ARRAY_APPLY(add_i, x, a, b, n, ARRAY_INTS, integer_value);
+                break;
+            case ARRAY_MUL:
+                ARRAY_APPLY(mul_i, x, a, b, n, ARRAY_INTS, integer_value);
+                break;
+            case ARRAY_DIV:
+                ARRAY_APPLY(div_i, x, a, b, n, ARRAY_INTS, integer_value);
+                break;
+            case ARRAY_LT:
+                ARRAY_APPLY(lt_i, x, a, b, n, ARRAY_INTS, integer_value);
+                break;
+        }
+    } else {
+        double *x = ARRAY_REALS(r);
+        switch (op) {
+            case ARRAY_ADD:
+                ARRAY_APPLY(add_r, x, a, b, n, ARRAY_REALS, real_value);
+                break;
+            case ARRAY_MUL:
+                ARRAY_APPLY(mul_r, x, a, b, n, ARRAY_REALS, real_value);
+                break;
+            case ARRAY_DIV:
+                ARRAY_APPLY(div_r, x, a, b, n, ARRAY_REALS, real_value);
+                break;
+            case ARRAY_LT:
+                ARRAY_APPLY(lt_r, ARRAY_INTS(r), a, b, n, ARRAY_REALS,
+                            real_value);
+                break;
+        }
+    }
+    NOS = r;
+    core_drop();
+}
+
+#undef ARRAY_APPLY
+
+static void core_array_add(void) { core_array_op(ARRAY_ADD); }
+static void core_array_mul(void) { core_array_op(ARRAY_MUL); }
+static void core_array_div(void) { core_array_op(ARRAY_DIV); }
+static void core_array_lt(void)  { core_array_op(ARRAY_LT); }
+
+// Sums of reals use four partial sums, since the compiler may not reorder
+// floating point additions by itself; the independent sums can be computed
+// in parallel (with SIMD instructions, or at least pipelined).
+static int64_t sum_i(const int64_t *restrict a, size_t n) {
+    uint64_t s = 0;
+    size_t i;
+    for (i=0; i<n; i++) s += a[i];
+    return s;
+}
+
+static double sum_r(const double *restrict a, size_t n) {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i;
+    for (i=0; i+4<=n; i+=4) {
+        s0 += a[i];
+        s1 += a[i+1];
+        s2 += a[i+2];
+        s3 += a[i+3];
+    }
+    for (; i<n; i++) s0 += a[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+static int64_t dot_i(const int64_t *restrict a, const int64_t *restrict b,
+                     size_t n) {
+    uint64_t s = 0;
+    size_t i;
+    for (i=0; i<n; i++) s += (uint64_t)a[i] * (uint64_t)b[i];
+    return s;
+}
+
+static double dot_r(const double *restrict a, const double *restrict b,
+                    size_t n) {
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i;
+    for (i=0; i+4<=n; i+=4) {
+        s0 += a[i] * b[i];
+        s1 += a[i+1] * b[i+1];
+        s2 += a[i+2] * b[i+2];
+        s3 += a[i+3] * b[i+3];
+    }
+    for (; i<n; i++) s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+// ( array -- x )
+static void core_array_sum(void) {
+    if (obj_type(TOS) == TYPE_INT_ARRAY)
+        TOS = new_integer(sum_i(ARRAY_INTS(TOS), ARRAY_LEN(TOS)));
+    else if (obj_type(TOS) == TYPE_REAL_ARRAY)
+        TOS = new_real(sum_r(ARRAY_REALS(TOS), ARRAY_LEN(TOS)));
+    else
+        lisp_error("Trying to sum type %d", obj_type(TOS));
+}
+
+// ( a b -- x )
+static void core_array_dot(void) {
+    if (!is_array(NOS) || obj_type(NOS) != obj_type(TOS) ||
+        ARRAY_LEN(NOS) != ARRAY_LEN(TOS))
+    {
+        lisp_error("Trying to multiply types %d and %d as vectors",
+                obj_type(NOS), obj_type(TOS));
+    }
+    if (obj_type(NOS) == TYPE_INT_ARRAY)
+        NOS = new_integer(dot_i(ARRAY_INTS(NOS), ARRAY_INTS(TOS),
+                                ARRAY_LEN(NOS)));
+    else
+        NOS = new_real(dot_r(ARRAY_REALS(NOS), ARRAY_REALS(TOS),
+                             ARRAY_LEN(NOS)));
+    core_drop();
+}
+
+// Bulk versions of the natfuns taking one number, for array-map.
+#define ARRAY_MAP(name, T, expr) \
+static void name(T *restrict r, const T *restrict a, size_t n) { \
+    size_t i; \
+    for (i=0; i<n; i++) { const T x = a[i]; r[i] = (expr); } \
+}
+
+ARRAY_MAP(neg_i, int64_t, (int64_t)-(uint64_t)x)
+ARRAY_MAP(neg_r, double, -x)
+
+#undef ARRAY_MAP
+
+static const struct {
+    natfun f;
+    void (*ints)(int64_t *restrict, const int64_t *restrict, size_t);
+    void (*reals)(double *restrict, const double *restrict, size_t);
+} array_unary[] = {
+    {core_neg, neg_i, neg_r},
+};
+
+// The natfuns taking two numbers which array-map applies with a scalar
+// operand, and the element-wise operations doing so.
+static const struct {
+    natfun f;
+    int op;
+} array_binary[] = {
+    {core_plus, ARRAY_ADD},
+    {core_mul,  ARRAY_MUL},
+    {core_div,  ARRAY_DIV},
+    {core_lt,   ARRAY_LT},
+};
+
+#define N_ELEMS(a)  (sizeof(a)/sizeof((a)[0]))
+
+// The element-wise operation of array_binary for the natfun o, or -1.
+static int array_binary_op(obj *o) {
+    size_t i;
+    if (obj_type(o) != TYPE_NATFUN) return -1;
+    const natfun f = ((native_natfun*)obj_binary_ptr(o))->x;
+    for (i=0; i<N_ELEMS(array_binary); i++) {
+        if (array_binary[i].f == f) return array_binary[i].op;
+    }
+    return -1;
+}
+
+static inline int is_number(obj *o) {
+    return obj_type(o) == TYPE_INTEGER || obj_type(o) == TYPE_REAL;
+}
+
+// ( f array -- array )
+// Apply f to every element, in bulk. Natfuns do not check how many
+// arguments they are given, so f must be one of array_unary, or a pair of
+// one of array_binary and a number x: f::x applies f to each element and x,
+// and x::f applies f to x and each element.
+static void core_array_map(void) {
+    array_assert(TOS);
+    int op;
+    if (obj_type(NOS) == TYPE_CONS && is_number(TAIL(NOS)) &&
+        (op = array_binary_op(HEAD(NOS))) >= 0)
+    {
+        push(TAIL(NOS));            // f::x array x
+        core_array_op(op);
+        core_nip();
+        return;
+    }
+    if (obj_type(NOS) == TYPE_CONS && is_number(HEAD(NOS)) &&
+        (op = array_binary_op(TAIL(NOS))) >= 0)
+    {
+        push(HEAD(NOS));
+        core_swap();                // x::f x array
+        core_array_op(op);
+        core_nip();
+        return;
+    }
+
+    const size_t n = ARRAY_LEN(TOS);
+    size_t i;
+    if (obj_type(NOS) == TYPE_NATFUN) {
+        const natfun f = ((native_natfun*)obj_binary_ptr(NOS))->x;
+        for (i=0; i<N_ELEMS(array_unary); i++) {
+            if (array_unary[i].f != f) continue;
+            push(new_array(obj_type(TOS), n));  // f a r
+            if (obj_type(TOS) == TYPE_INT_ARRAY)
+                array_unary[i].ints(ARRAY_INTS(TOS), ARRAY_INTS(NOS), n);
+            else
+                array_unary[i].reals(ARRAY_REALS(TOS), ARRAY_REALS(NOS), n);
+            NNOS = TOS;
+            core_drop();
+            core_drop();
+            return;
+        }
+    }
+    lisp_error("Can not map type %d over an array", obj_type(NOS));
+}
+
+#undef N_ELEMS
+
+#endif
@@ -0,0 +1,17 @@
+(define - (lambda (x y) (+ x (neg y))))
+
+(define ack
+  (lambda (m n)
+    (if (= m 0)
+      (+ n 1)
+      (if (= n 0)
+        (ack (- m 1) 1)
+        (ack (- m 1) (ack m (- n 1)))))))
+
+(define repeat
+  (lambda (n f x)
+    (if (= n 0)
+      x
+      (repeat (- n 1) f (f)))))
+
+(print (repeat 8 (lambda () (ack 3 6)) ()))
@@ -0,0 +1,28 @@
+(define - (lambda (x y) (+ x (neg y))))
+
+(define make-list
+  (lambda (n x xs)
+    (if (= n 0)
+      xs
+      (make-list (- n 1) x (cons x xs)))))
+
+(define churn
+  (lambda (n x)
+    (if (= n 0)
+      x
+      (churn (- n 1) (+ 0.5 (head (make-list 20 x ())))))))
+
+(define keep
+  (lambda (n xs)
+    (if (= n 0)
+      xs
+      (keep (- n 1) (cons (make-list 8 n ()) xs)))))
+
+(define length-onto
+  (lambda (xs n)
+    (if (= xs ())
+      n
+      (length-onto (tail xs) (+ n 1)))))
+
+(print (churn 100000 0.0))
+(print (length-onto (keep 100000 ()) 0))
@@ -0,0 +1,429 @@
+(define - (lambda (x y) (+ x (neg y))))
+
+(define g0 0)
+(define g1 1)
+(define g2 2)
+(define g3 3)
+(define g4 4)
+(define g5 5)
+(define g6 6)
+(define g7 7)
+(define g8 8)
+(define g9 9)
+(define g10 10)
+(define g11 11)
+(define g12 12)
+(define g13 13)
+(define g14 14)
+(define g15 15)
+(define g16 16)
+(define g17 17)
+(define g18 18)
+(define g19 19)
+(define g20 20)
+(define g21 21)
+(define g22 22)
+(define g23 23)
+(define g24 24)
+(define g25 25)
+(define g26 26)
+(define g27 27)
+(define g28 28)
+(define g29 29)
+(define g30 30)
+(define g31 31)
+(define g32 32)
+(define g33 33)
+(define g34 34)
+(define g35 35)
+(define g36 36)
+(define g37 37)
+(define g38 38)
+(define g39 39)
+(define g40 40)
+(define g41 41)
+(define g42 42)
+(define g43 43)
+(define g44 44)
+(define g45 45)
+(define g46 46)
+(define g47 47)
+(define g48 48)
+(define g49 49)
+(define g50 50)
+(define g51 51)
+(define g52 52)
+(define g53 53)
+(define g54 54)
+(define g55 55)
+(define g56 56)
+(define g57 57)
+(define g58 58)
+(define g59 59)
+(define g60 60)
+(define g61 61)
+(define g62 62)
+(define g63 63)
+(define g64 64)
+(define g65 65)
+(define g66 66)
+(define g67 67)
+(define g68 68)
+(define g69 69)
+(define g70 70)
+(define g71 71)
+(define g72 72)
+(define g73 73)
+(define g74 74)
+(define g75 75)
+(define g76 76)
+(define g77 77)
+(define g78 78)
+(define g79 79)
+(define g80 80)
+(define g81 81)
+(define g82 82)
+(define g83 83)
+(define g84 84)
+(define g85 85)
+(define g86 86)
+(define g87 87)
+(define g88 88)
+(define g89 89)
+(define g90 90)
+(define g91 91)
+(define g92 92)
+(define g93 93)
+(define g94 94)
+(define g95 95)
+(define g96 96)
+(define g97 97)
+(define g98 98)
+(define g99 99)
+(define g100 100)
+(define g101 101)
+(define g102 102)
+(define g103 103)
+(define g104 104)
+(define g105 105)
+(define g106 106)
+(define g107 107)
+(define g108 108)
+(define g109 109)
+(define g110 110)
+(define g111 111)
+(define g112 112)
+(define g113 113)
+(define g114 114)
+(define g115 115)
+(define g116 116)
+(define g117 117)
+(define g118 118)
+(define g119 119)
+(define g120 120)
+(define g121 121)
+(define g122 122)
+(define g123 123)
+(define g124 124)
+(define g125 125)
+(define g126 126)
+(define g127 127)
+(define g128 128)
+(define g129 129)
+(define g130 130)
+(define g131 131)
+(define g132 132)
+(define g133 133)
+(define g134 134)
+(define g135 135)
+(define g136 136)
+(define g137 137)
+(define g138 138)
+(define g139 139)
+(define g140 140)
+(define g141 141)
+(define g142 142)
+(define g143 143)
+(define g144 144)
+(define g145 145)
+(define g146 146)
+(define g147 147)
+(define g148 148)
+(define g149 149)
+(define g150 150)
+(define g151 151)
+(define g152 152)
+(define g153 153)
+(define g154 154)
+(define g155 155)
+(define g156 156)
+(define g157 157)
+(define g158 158)
+(define g159 159)
+(define g160 160)
+(define g161 161)
+(define g162 162)
+(define g163 163)
+(define g164 164)
+(define g165 165)
+(define g166 166)
+(define g167 167)
+(define g168 168)
+(define g169 169)
+(define g170 170)
+(define g171 171)
+(define g172 172)
+(define g173 173)
+(define g174 174)
+(define g175 175)
+(define g176 176)
+(define g177 177)
+(define g178 178)
+(define g179 179)
+(define g180 180)
+(define g181 181)
+(define g182 182)
+(define g183 183)
+(define g184 184)
+(define g185 185)
+(define g186 186)
+(define g187 187)
+(define g188 188)
+(define g189 189)
+(define g190 190)
+(define g191 191)
+(define g192 192)
+(define g193 193)
+(define g194 194)
+(define g195 195)
+(define g196 196)
+(define g197 197)
+(define g198 198)
+(define g199 199)
+(define g200 200)
+(define g201 201)
+(define g202 202)
+(define g203 203)
+(define g204 204)
+(define g205 205)
+(define g206 206)
+(define g207 207)
+(define g208 208)
+(define g209 209)
+(define g210 210)
+(define g211 211)
+(define g212 212)
+(define g213 213)
+(define g214 214)
+(define g215 215)
+(define g216 216)
+(define g217 217)
+(define g218 218)
+(define g219 219)
+(define g220 220)
+(define g221 221)
+(define g222 222)
+(define g223 223)
+(define g224 224)
+(define g225 225)
+(define g226 226)
+(define g227 227)
+(define g228 228)
+(define g229 229)
+(define g230 230)
+(define g231 231)
+(define g232 232)
+(define g233 233)
+(define g234 234)
+(define g235 235)
+(define g236 236)
+(define g237 237)
+(define g238 238)
+(define g239 239)
+(define g240 240)
+(define g241 241)
+(define g242 242)
+(define g243 243)
+(define g244 244)
+(define g245 245)
+(define g246 246)
+(define g247 247)
+(define g248 248)
+(define g249 249)
+(define g250 250)
+(define g251 251)
+(define g252 252)
+(define g253 253)
+(define g254 254)
+(define g255 255)
+(define g256 256)
+(define g257 257)
+(define g258 258)
+(define g259 259)
+(define g260 260)
+(define g261 261)
+(define g262 262)
+(define g263 263)
+(define g264 264)
+(define g265 265)
+(define g266 266)
+(define g267 267)
+(define g268 268)
+(define g269 269)
+(define g270 270)
+(define g271 271)
+(define g272 272)
+(define g273 273)
+(define g274 274)
+(define g275 275)
+(define g276 276)
+(define g277 277)
+(define g278 278)
+(define g279 279)
+(define g280 280)
+(define g281 281)
+(define g282 282)
+(define g283 283)
+(define g284 284)
+(define g285 285)
+(define g286 286)
+(define g287 287)
+(define g288 288)
+(define g289 289)
+(define g290 290)
+(define g291 291)
+(define g292 292)
+(define g293 293)
+(define g294 294)
+(define g295 295)
+(define g296 296)
+(define g297 297)
+(define g298 298)
+(define g299 299)
+(define g300 300)
+(define g301 301)
+(define g302 302)
+(define g303 303)
+(define g304 304)
+(define g305 305)
+(define g306 306)
+(define g307 307)
+(define g308 308)
+(define g309 309)
+(define g310 310)
+(define g311 311)
+(define g312 312)
+(define g313 313)
+(define g314 314)
+(define g315 315)
+(define g316 316)
+(define g317 317)
+(define g318 318)
+(define g319 319)
+(define g320 320)
+(define g321 321)
+(define g322 322)
+(define g323 323)
+(define g324 324)
+(define g325 325)
+(define g326 326)
+(define g327 327)
+(define g328 328)
+(define g329 329)
+(define g330 330)
+(define g331 331)
+(define g332 332)
+(define g333 333)
+(define g334 334)
+(define g335 335)
+(define g336 336)
+(define g337 337)
+(define g338 338)
+(define g339 339)
+(define g340 340)
+(define g341 341)
+(define g342 342)
+(define g343 343)
+(define g344 344)
+(define g345 345)
+(define g346 346)
+(define g347 347)
+(define g348 348)
+(define g349 349)
+(define g350 350)
+(define g351 351)
+(define g352 352)
+(define g353 353)
+(define g354 354)
+(define g355 355)
+(define g356 356)
+(define g357 357)
+(define g358 358)
+(define g359 359)
+(define g360 360)
+(define g361 361)
+(define g362 362)
+(define g363 363)
+(define g364 364)
+(define g365 365)
+(define g366 366)
+(define g367 367)
+(define g368 368)
+(define g369 369)
+(define g370 370)
+(define g371 371)
+(define g372 372)
+(define g373 373)
+(define g374 374)
+(define g375 375)
+(define g376 376)
+(define g377 377)
+(define g378 378)
+(define g379 379)
+(define g380 380)
+(define g381 381)
+(define g382 382)
+(define g383 383)
+(define g384 384)
+(define g385 385)
+(define g386 386)
+(define g387 387)
+(define g388 388)
+(define g389 389)
+(define g390 390)
+(define g391 391)
+(define g392 392)
+(define g393 393)
+(define g394 394)
+(define g395 395)
+(define g396 396)
+(define g397 397)
+(define g398 398)
+(define g399 399)
+
+(define sum-globals
+  (lambda ()
+    (+ (+ (+ g0 g37) (+ g101 g150)) (+ (+ g222 g250) (+ g333 g399)))))
+
+(define loop
+  (lambda (n acc)
+    (if (= n 0)
+      acc
+      (loop (- n 1) (+ acc (sum-globals))))))
+
+(define bind-all
+  (lambda (env n)
+    (if (= n 0)
+      env
+      (bind-all (extend env n (* n n)) (- n 1)))))
+
+(define env (bind-all (global) 200))
+
+(define count-found
+  (lambda (n acc)
+    (if (= n 0)
+      acc
+      (count-found (- n 1) (if (lookup env (+ (* 7 n) 13)) (+ acc 1) acc)))))
+
+(print (loop 400000 0))
+(print (count-found 40000 0))
@@ -0,0 +1,9 @@
+(define - (lambda (x y) (+ x (neg y))))
+
+(define fib
+  (lambda (n)
+    (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2))))))
+
+(print (fib 27))
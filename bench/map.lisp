@@ -0,0 +1,47 @@
+(define - (lambda (x y) (+ x (neg y))))
+
+(define reverse-onto
+  (lambda (xs ys)
+    (if (= xs ())
+      ys
+      (reverse-onto (tail xs) (cons (head xs) ys)))))
+
+(define reverse (lambda (xs) (reverse-onto xs ())))
+
+(define range-onto
+  (lambda (x y xs)
+    (if (< y x)
+      xs
+      (range-onto x (- y 1) (cons y xs)))))
+
+(define range (lambda (x y) (range-onto x y ())))
+
+(define map-onto
+  (lambda (f xs ys)
+    (if (= xs ())
+      (reverse ys)
+      (map-onto f (tail xs) (cons (f (head xs)) ys)))))
+
+(define map (lambda (f xs) (map-onto f xs ())))
+
+(define sum-onto
+  (lambda (xs n)
+    (if (= xs ())
+      n
+      (sum-onto (tail xs) (+ n (head xs))))))
+
+(define sum (lambda (xs) (sum-onto xs 0)))
+
+(define square (lambda (x) (* x x)))
+(define inc (lambda (x) (+ x 1)))
+
+(define xs (range 1 100000))
+
+(define loop
+  (lambda (n acc)
+    (if (= n 0)
+      acc
+      (loop (- n 1) (+ acc (sum (map square (map inc xs))))))))
+
+(print (loop 4 0))
+(print (head (reverse (map (lambda (x) (cons x x)) (range 1 100000)))))
@@ -0,0 +1,127 @@
+#!/bin/sh
+# Run the benchmarks and report wall time and memory management statistics.
+#
+# Usage: bench/run.sh [-n RUNS] [-o FILE] [-c FILE] [-t PERCENT] [LISP]
+#
+#   -n RUNS     run each benchmark RUNS times and report the fastest (3)
+#   -o FILE     write the results to FILE, to be used as a baseline later
+#   -c FILE     compare the results against the baseline in FILE, and exit
+#               with status 1 if anything regressed
+#   -t PERCENT  tolerated slowdown relative to the baseline (10)
+#   LISP        the interpreter to run (./lisp)
+#
+# Results are tab separated: benchmark name, wall time in milliseconds,
+# number of allocations, bytes allocated, number of collections and peak
+# heap size in bytes. The last four are deterministic, so any increase is
+# reported as a regression.
+
+set -e
+
+runs=3
+out=
+baseline=
+tolerance=10
+
+while getopts n:o:c:t: opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        o) out=$OPTARG ;;
+        c) baseline=$OPTARG ;;
+        t) tolerance=$OPTARG ;;
+        *) sed -n '4,11s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+lisp=${1:-./lisp}
+dir=$(dirname "$0")
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Parsing: a data file of about 4 MB, generated here rather than kept in git.
+awk 'BEGIN {
+    print "(define data (quote ("
+    for (i = 0; i < 40000; i++)
+        printf "  (record %d \"name-%d\" %d.%d (tag-%d x y z) (%d %d %d))\n",
+               i, i, i, i % 10, i % 100, i * 3, -i, i % 7
+    print ")))"
+    print "(define length-onto"
+    print "  (lambda (xs n) (if (= xs ()) n (length-onto (tail xs) (+ n 1)))))"
+    print "(print (length-onto data 0))"
+}' > "$tmp/parse.lisp"
+
+# Print a tab separated file with aligned columns.
+align() {
+    awk -F '\t' '
+        { for (i = 1; i <= NF; i++) {
+              cell[NR, i] = $i
+              if (length($i) > width[i]) width[i] = length($i)
+          }
+          n[NR] = NF }
+        END { for (r = 1; r <= NR; r++) {
+                  line = ""
+                  for (i = 1; i < n[r]; i++)
+                      line = line sprintf("%-" width[i] "s  ", cell[r, i])
+                  print line cell[r, n[r]]
+              } }' "$1"
+}
+
+results=$tmp/results
+printf 'benchmark\ttime_ms\tallocations\tbytes_allocated\tcollections\tpeak_heap\n' > "$results"
+
+for prog in "$dir"/*.lisp "$tmp/parse.lisp"; do
+    name=$(basename "$prog" .lisp)
+    best=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        start=$(date +%s%N)
+        if ! LISP_STATS=1 "$lisp" < "$prog" > /dev/null 2> "$tmp/stats"; then
+            echo "$name: failed" >&2
+            cat "$tmp/stats" >&2
+            exit 1
+        fi
+        end=$(date +%s%N)
+        ms=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then best=$ms; fi
+        i=$((i + 1))
+    done
+    awk -v name="$name" -v ms="$best" '
+        { stat[$1] = $2 }
+        END {
+            printf "%s\t%d\t%d\t%d\t%d\t%d\n", name, ms, stat["allocations"],
+                   stat["bytes-allocated"],
+                   stat["minor-collections"] + stat["major-collections"],
+                   stat["used-peak"]
+        }' "$tmp/stats" >> "$results"
+done
+
+if [ -n "$out" ]; then cp "$results" "$out"; fi
+
+if [ -z "$baseline" ]; then
+    align "$results"
+    exit 0
+fi
+
+# Print each result next to the baseline, marking regressions with "!".
+status=0
+awk -F '\t' -v tolerance="$tolerance" '
+    NR == FNR { for (i = 2; i <= NF; i++) base[$1, i] = $i; next }
+    FNR == 1 { print; next }
+    {
+        line = $1
+        for (i = 2; i <= NF; i++) {
+            mark = ""
+            if (($1, i) in base) {
+                limit = base[$1, i]
+                if (i == 2) limit = limit * (1 + tolerance / 100) + 1
+                if ($i > limit) { mark = "!"; failed = 1 }
+                line = line "\t" base[$1, i] " -> " $i mark
+            } else {
+                line = line "\t" $i
+            }
+        }
+        print line
+    }
+    END { exit failed }' "$baseline" "$results" > "$tmp/report" || status=1
+align "$tmp/report"
+exit $status
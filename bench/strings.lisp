@@ -0,0 +1,42 @@
+(define - (lambda (x y) (+ x (neg y))))
+
+(define words
+  (quote ("lorem" "ipsum" "dolor" "sit" "amet" "consectetur" "adipiscing"
+          "elit" "sed" "do" "eiusmod" "tempor" "incididunt" "ut" "labore"
+          "et" "dolore" "magna" "aliqua" "ut" "enim" "ad" "minim" "veniam"
+          "quis" "nostrud" "exercitation" "ullamco" "laboris" "nisi" "ut"
+          "aliquip" "ex" "ea" "commodo" "consequat")))
+
+(define count-onto
+  (lambda (w xs n)
+    (if (= xs ())
+      n
+      (count-onto w (tail xs) (if (= w (head xs)) (+ n 1) n)))))
+
+(define tally
+  (lambda (xs env)
+    (if (= xs ())
+      env
+      (tally (tail xs)
+             (if (lookup env (head xs))
+               env
+               (extend env (head xs) (count-onto (head xs) words 0)))))))
+
+(define sentence
+  (quote (("the" "quick" "brown" "fox") ("jumps" "over") ("the" "lazy" "dog"))))
+
+(define loop
+  (lambda (n acc)
+    (if (= n 0)
+      acc
+      (loop (- n 1)
+            (+ (+ acc (count-onto "ut" words 0))
+               (if (= sentence (quote (("the" "quick" "brown" "fox")
+                                       ("jumps" "over")
+                                       ("the" "lazy" "dog"))))
+                 1
+                 0))))))
+
+(print (loop 50000 0))
+(print (lookup (tally words ()) "dolore"))
+(print (++ (head sentence) (head (tail sentence))))
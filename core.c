@@ -1,6 +1,8 @@
 #ifndef __CORE_C__
 #define __CORE_C__
 
+#include <inttypes.h>
+
 #include "mem.c"
 
 // ( a b -- b a )
@@ -39,27 +41,14 @@ static void core_rot(void) {
     NOS = o;
 }
 
-// ( -- nil )
-static void core_nil(void) {
-    push(NIL);
-}
-
 // ( a b -- a::b )
 static void core_cons(void) {
-    obj *o = new_obj(2, sizeof(native_type));
-    *(native_type*)obj_binary_ptr(o) = TYPE_CONS;
+    obj *o = new_small(TYPE_CONS, 2, 0);
     TAIL(o) = pop();
     HEAD(o) = pop();
     push(o);
 }
 
-// ( a::b -- a b )
-static void core_decons(void) {
-    core_dup();
-    NOS = HEAD(NOS);
-    TOS = TAIL(TOS);
-}
-
 // ( a::b -- a )
 static void core_head(void) {
     obj_assert_type(TOS, TYPE_CONS);
@@ -73,69 +62,295 @@ static void core_tail(void) {
 }
 
 // ( a b -- a++b )
+// The cells of a are copied front to back, each copy becoming the tail of
+// the previous one, so the C stack does not grow with the length of a.
 static void core_append(void) {
     if (NOS == NIL) {
         core_nip();
         return;
     }
-    push(HEAD(NOS));        // a b head(a)
-    core_rot();             // b head(a) a
-    core_tail();            // b head(a) tail(a)
-    core_rot();             // head(a) tail(a) b
-    core_append();          // head(a) tail(a)++b
-    core_cons();            // head(a)::tail(a)++b = a++b
+    push(NIL);              // a b nil
+    push(NIL);              // a b list last
+    while (PICK(3) != NIL) {
+        obj_assert_type(PICK(3), TYPE_CONS);
+        push(HEAD(PICK(3)));
+        push(NIL);
+        core_cons();        // a b list last head(a)::nil
+        if (NOS == NIL) {
+            PICK(2) = TOS;
+        } else {
+            TAIL(NOS) = TOS;
+            gc_write(&vm->heap, NOS);
+        }
+        core_nip();         // a b list last'
+        PICK(3) = TAIL(PICK(3));
+    }
+    TAIL(TOS) = PICK(2);    // nil b a++b last
+    gc_write(&vm->heap, TOS);
+    core_drop();
+    PICK(2) = TOS;
+    core_drop();
+    core_drop();
+}
+
+// A pair of objects being compared by obj_equal(), and the index of the next
+// pair of references to compare. The last references are compared in place
+// of the frame, so comparing the spine of a list takes a single frame.
+typedef struct {
+    obj *a, *b;
+    size_t i;
+} eq_frame;
+
+static __thread eq_frame *eq_stack;
+static __thread size_t eq_stack_size;
+
+// Free the comparison stack of this thread, until obj_equal() needs it again.
+static void eq_stack_free(void) {
+    free(eq_stack);
+    eq_stack = NULL;
+    eq_stack_size = 0;
+}
+
+// Pairs which have already been compared (or are being compared) are
+// assumed to be equal: if they are not, a difference is found elsewhere.
+// Pairs are only recorded after EQ_FUEL steps, so that small and acyclic
+// objects are compared without hashing. Cyclic objects then terminate, and
+// shared structure is compared once.
+#define EQ_FUEL         0x400
+
+typedef struct {
+    obj **x;                    // pairs of objects, or NULL
+    size_t size, count;         // number of pairs
+} eq_set;
+
+static inline size_t eq_hash(obj *a, obj *b) {
+    return ((uintptr_t)a * 0x9e3779b97f4a7c15ull) ^ (uintptr_t)b >> 3;
+}
+
+// Add the pair (a, b) to s, and return zero if it was already there.
+static int eq_set_add(eq_set *s, obj *a, obj *b) {
+    size_t i;
+    if (2*(s->count + 1) > s->size) {
+        eq_set old = *s;
+        s->size = (old.size)? 2*old.size : 0x100;
+        s->x = calloc(2*s->size, sizeof(obj*));
+        s->count = 0;
+        for (i=0; i<old.size; i++) {
+            if (old.x[2*i]) eq_set_add(s, old.x[2*i], old.x[2*i+1]);
+        }
+        free(old.x);
+    }
+    const size_t mask = s->size - 1;
+    for (i=eq_hash(a, b) & mask; s->x[2*i]; i=(i+1) & mask) {
+        if (s->x[2*i] == a && s->x[2*i+1] == b) return 0;
+    }
+    s->x[2*i] = a;
+    s->x[2*i+1] = b;
+    s->count++;
+    return 1;
+}
+
+// Compare everything but the references of a and b, which are not
+// identical. Symbols are only equal to themselves.
+static inline int eq_shallow(obj *a, obj *b) {
+    return gc_is_ref(a) && gc_is_ref(b) && a && b &&
+           obj_type(a) == obj_type(b) && obj_type(a) != TYPE_SYMBOL &&
+           obj_n_refs(a) == obj_n_refs(b) &&
+           obj_binary_size(a) == obj_binary_size(b) &&
+           !memcmp(obj_binary_ptr(a), obj_binary_ptr(b), obj_binary_size(a));
+}
+
+// Structural equality. It does not allocate in the heap, and takes constant
+// C stack space.
+static int obj_equal(obj *a, obj *b) {
+    eq_set seen = {NULL, 0, 0};
+    size_t depth = 0, fuel = EQ_FUEL;
+    int result = 1;
+    for (;;) {
+        if (a != b) {
+            if (!eq_shallow(a, b)) {
+                result = 0;
+                break;
+            }
+            if (obj_n_refs(a) && (fuel? fuel-- : eq_set_add(&seen, a, b))) {
+                if (depth == eq_stack_size) {
+                    eq_stack_size = (eq_stack_size)? 2*eq_stack_size : 0x40;
+                    eq_stack = realloc(eq_stack,
+                                       eq_stack_size*sizeof(eq_frame));
+                }
+                eq_stack[depth].a = a;
+                eq_stack[depth].b = b;
+                eq_stack[depth].i = 0;
+                depth++;
+            }
+        }
+        if (!depth) break;
+        eq_frame *f = &eq_stack[depth-1];
+        a = f->a->ref[f->i];
+        b = f->b->ref[f->i];
+        if (++f->i == f->a->len) depth--;
+    }
+    free(seen.x);
+    return result;
 }
 
 // ( a b -- c )
-// TODO: handle cycles
 static void core_eq(void) {
-    if (TOS == NOS) {
-        core_drop();
-        core_drop();
-        push(TRUE);
-    } else {
-        int result = 0;
-        if (obj_n_refs(TOS) == obj_n_refs(NOS) &&
-            obj_binary_size(TOS) == obj_binary_size(NOS))
-        {
-            if (!memcmp(obj_binary_ptr(TOS), obj_binary_ptr(NOS),
-                        obj_binary_size(TOS)))
-            {
-                if (TOS->refs) {
-                    result = 1;
-                    size_t i;
-                    for (i=0; i<TOS->len; i++) {
-                        push(TOS->ref[i]);
-                        push(NOS->ref[i]);
-                        core_eq();
-                        if (pop() == FALSE) {
-                            result = 0;
-                            break;
-                        }
-                    }
-                } else result = 1;
-            }
+    const int result = (TOS == NOS) || obj_equal(TOS, NOS);
+    core_drop();
+    TOS = (result)? TRUE : FALSE;
+}
+
+// Structural hash, consistent with obj_equal(): it combines the obj_hash()
+// of the first HASH_NODES objects reached from o in depth first order, so it
+// takes constant time and space, also for cyclic objects. It does not follow
+// the environment of lambdas, nor the global lookups cached in code objects,
+// since these change when a lambda runs or a global is defined.
+#define HASH_NODES      0x20
+
+// Whether obj_hash_deep() follows reference i of o.
+static inline int hash_follows(obj *o, size_t i) {
+    switch (obj_type(o)) {
+    case TYPE_LAMBDA:
+        return i == 0;
+    case TYPE_CODE:
+        return i < 3 || (i - 3) % 3 == 0;
+    default:
+        return 1;
+    }
+}
+
+static uint32_t obj_hash_deep(obj *o) {
+    obj *todo[HASH_NODES];
+    size_t n = 1, count, i;
+    uint32_t h = 2166136261U;
+    todo[0] = o;
+    for (count=0; n && count<HASH_NODES; count++) {
+        o = todo[--n];
+        if (o == NULL) continue;
+        h = (h ^ obj_hash(o)) * 16777619U;
+        if (!gc_is_ref(o)) continue;
+        for (i=obj_n_refs(o); i-- && n<HASH_NODES; ) {
+            if (hash_follows(o, i)) todo[n++] = o->ref[i];
         }
-        core_drop();
-        core_drop();
-        push((result)? TRUE : FALSE);
+    }
+    return h;
+}
+
+// Index of the slot for key in the table of the first frame of env. This is
+// either the slot where key is bound, or the empty slot where it should go.
+static size_t env_slot(obj *env, obj *key, uint32_t hash) {
+    obj *slots = ENV_SLOTS(env);
+    size_t mask = slots->len/2 - 1;
+    size_t i = hash & mask;
+    for (;;) {
+        obj *k = slots->ref[2*i];
+        if (k == NIL || k == key) return 2*i;
+        if (obj_hash(k) == hash && obj_type(k) != TYPE_SYMBOL) {
+            push(k);
+            push(key);
+            core_eq();
+            if (pop() == TRUE) return 2*i;
+        }
+        i = (i+1) & mask;
+    }
+}
+
+// ( parent -- env )
+// Create an empty environment frame with room for n bindings.
+static void core_env(size_t n) {
+    size_t cap = 2, i;
+    while (cap < 2*n) cap *= 2;
+    obj *slots = new_obj(TYPE_VECTOR, 2*cap, 0);
+    for (i=0; i<2*cap; i++) slots->ref[i] = NIL;
+    push(slots);
+    native_env data;
+    data.count = 0;
+    obj *o = new_obj_fill(TYPE_ENV, 2, &data, sizeof(data));
+    ENV_SLOTS(o) = pop();
+    ENV_PARENT(o) = TOS;
+    TOS = o;
+}
+
+// ( env -- env )
+// Double the capacity of the first frame of env.
+static void core_rehash(void) {
+    size_t len = ENV_SLOTS(TOS)->len, i;
+    obj *slots = new_obj(TYPE_VECTOR, 2*len, 0);
+    for (i=0; i<2*len; i++) slots->ref[i] = NIL;
+    obj *old = ENV_SLOTS(TOS);
+    ENV_SLOTS(TOS) = slots;
+    gc_write(&vm->heap, TOS);
+    for (i=0; i<len; i+=2) {
+        if (old->ref[i] != NIL) {
+            size_t j = env_slot(TOS, old->ref[i], obj_hash(old->ref[i]));
+            slots->ref[j] = old->ref[i];
+            slots->ref[j+1] = old->ref[i+1];
+        }
+    }
+}
+
+// Every define increments the env_version of the interpreter, which
+// invalidates the global lookups cached in its code objects.
+static inline void env_changed(void) {
+    vm->env_version++;
+}
+
+// Clear the global lookups cached in code object o.
+static void code_clear_caches(obj *o) {
+    size_t i;
+    for (i=0; i<CODE_N_CONSTS(o); i++) {
+        CODE_CACHE(o, i) = NIL;
+        CODE_VERSION(o, i) = NIL;
     }
 }
 
+// ( env key value -- env )
+// Bind key to value in the first frame of env, replacing any binding of key
+// in that frame. This modifies env in place.
+static void core_define(void) {
+    if (NOS == NIL) {
+        lisp_error("Can not bind nil");
+    }
+    if (NNOS == NIL) {
+        core_rot();
+        core_env(1);
+        core_rot();
+        core_rot();
+    }
+    if (4*(ENV_COUNT(NNOS)+1) > ENV_SLOTS(NNOS)->len) {
+        core_rot();
+        core_rehash();
+        core_rot();
+        core_rot();
+    }
+    size_t i = env_slot(NNOS, NOS, obj_hash(NOS));
+    obj *slots = ENV_SLOTS(NNOS);
+    if (slots->ref[i] == NIL) {
+        slots->ref[i] = NOS;
+        ENV_COUNT(NNOS)++;
+    }
+    slots->ref[i+1] = TOS;
+    gc_write_ref(&vm->heap, slots, i);
+    gc_write_ref(&vm->heap, slots, i+1);
+    env_changed();
+    core_drop();
+    core_drop();
+}
+
 // ( map key -- value true/false )
 static void core_lookup(void) {
+    uint32_t hash = obj_hash(TOS);
     while (NOS != NIL) {
-        push(HEAD(HEAD(NOS)));
-        core_over();
-        core_eq();
-        if (pop() == TRUE) {
+        size_t i = env_slot(NOS, TOS, hash);
+        obj *slots = ENV_SLOTS(NOS);
+        if (slots->ref[i] != NIL) {
             core_drop();
-            TOS = HEAD(TAIL(HEAD(TOS)));
+            TOS = slots->ref[i+1];
             push(TRUE);
             return;
-        } else {
-            NOS = TAIL(NOS);
         }
+        NOS = ENV_PARENT(NOS);
     }
     core_drop();
     core_drop();
@@ -144,24 +359,20 @@ static void core_lookup(void) {
 
 // ( map key value -- map )
 static void core_extend(void) {
-    core_nil();
-    core_cons();
-    core_cons();
-    core_swap();
-    core_cons();
+    core_rot();
+    core_env(1);
+    core_rot();
+    core_rot();
+    core_define();
 }
 
-// ( vars body env -- lambda )
+// ( code env -- lambda )
 static void core_lambda(void) {
-    native_type type = TYPE_LAMBDA;
-    obj *o = new_obj_fill(3, &type, sizeof(type));
-    o->ref[0] = NNOS;
-    o->ref[1] = NOS;
-    o->ref[2] = TOS;
+    obj *o = new_small(TYPE_LAMBDA, 2, 0);
+    LAMBDA_CODE(o) = NOS;
+    LAMBDA_ENV(o) = TOS;
     core_drop();
-    core_drop();
-    core_drop();
-    push(o);
+    TOS = o;
 }
 
 // ( natfun -- )
@@ -171,19 +382,103 @@ static void core_execute(void) {
     nf->x();
 }
 
+// ( n -- vector )
+// Allocate a vector of n elements, which are nil.
+static void core_vector(size_t n) {
+    if (n > OBJ_LEN_MAX) {
+        lisp_error("Vector length %zu too large", n);
+    }
+    obj *o = new_obj(TYPE_VECTOR, n, 0);
+    size_t i;
+    for (i=0; i<n; i++) VECTOR_REF(o, i) = NIL;
+    push(o);
+}
+
+static size_t vector_index(obj *v, obj *i) {
+    obj_assert_type(i, TYPE_INTEGER);
+    if (integer_value(i) < 0 || (uint64_t)integer_value(i) >= VECTOR_LEN(v)) {
+        lisp_error("Vector index %" PRId64 " out of range (length %zu)",
+                integer_value(i), VECTOR_LEN(v));
+    }
+    return integer_value(i);
+}
+
+// ( n x -- vector )
+static void core_make_vector(void) {
+    obj_assert_type(NOS, TYPE_INTEGER);
+    if (integer_value(NOS) < 0) {
+        lisp_error("Negative vector length %" PRId64, integer_value(NOS));
+    }
+    if ((uint64_t)integer_value(NOS) > OBJ_LEN_MAX) {
+        lisp_error("Vector length %" PRId64 " too large", integer_value(NOS));
+    }
+    size_t i, n = integer_value(NOS);
+    core_vector(n);
+    for (i=0; i<n; i++) VECTOR_REF(TOS, i) = NOS;
+    NNOS = TOS;
+    core_drop();
+    core_drop();
+}
+
+// ( vector i -- x )
+static void core_vector_ref(void) {
+    obj_assert_type(NOS, TYPE_VECTOR);
+    NOS = VECTOR_REF(NOS, vector_index(NOS, TOS));
+    core_drop();
+}
+
+// ( vector i x -- vector )
+static void core_vector_set(void) {
+    obj_assert_type(NNOS, TYPE_VECTOR);
+    const size_t i = vector_index(NNOS, NOS);
+    VECTOR_REF(NNOS, i) = TOS;
+    gc_write_ref(&vm->heap, NNOS, i);
+    core_drop();
+    core_drop();
+}
+
+// ( vector -- n )
+static void core_vector_length(void) {
+    obj_assert_type(TOS, TYPE_VECTOR);
+    TOS = new_integer(VECTOR_LEN(TOS));
+}
+
+// ( list -- vector )
+static void core_list_vector(void) {
+    size_t i, n = 0;
+    obj *l;
+    for (l=TOS; obj_type(l) == TYPE_CONS; l=TAIL(l)) n++;
+    if (l != NIL) {
+        lisp_error("Trying to convert an improper list to a vector");
+    }
+    core_vector(n);
+    for (i=0, l=NOS; i<n; i++, l=TAIL(l)) VECTOR_REF(TOS, i) = HEAD(l);
+    core_nip();
+}
+
+// ( vector -- list )
+static void core_vector_list(void) {
+    obj_assert_type(TOS, TYPE_VECTOR);
+    size_t i = VECTOR_LEN(TOS);
+    push(NIL);
+    while (i > 0) {
+        push(VECTOR_REF(NOS, --i));
+        core_swap();
+        core_cons();
+    }
+    core_nip();
+}
+
 // ( a b -- a+b )
 static void core_plus(void) {
     if (obj_type(NOS) == TYPE_INTEGER && obj_type(TOS) == TYPE_INTEGER) {
-        NOS = new_integer(
-                    ((native_integer*)obj_binary_ptr(NOS))->x +
-                    ((native_integer*)obj_binary_ptr(TOS))->x);
+        NOS = new_integer(integer_value(NOS) + integer_value(TOS));
         core_drop();
     } else if(obj_type(NOS) == TYPE_REAL && obj_type(TOS) == TYPE_REAL) {
-        NOS = new_real(
-                ((native_real*)obj_binary_ptr(NOS))->x +
-                ((native_real*)obj_binary_ptr(TOS))->x);
+        NOS = new_real(real_value(NOS) + real_value(TOS));
+        core_drop();
     } else {
-        error(1, 0, "Trying to add types %d and %d",
+        lisp_error("Trying to add types %d and %d",
                 obj_type(NOS), obj_type(TOS));
     }
 }
@@ -191,16 +486,13 @@ static void core_plus(void) {
 // ( a b -- a*b )
 static void core_mul(void) {
     if (obj_type(NOS) == TYPE_INTEGER && obj_type(TOS) == TYPE_INTEGER) {
-        NOS = new_integer(
-                    ((native_integer*)obj_binary_ptr(NOS))->x *
-                    ((native_integer*)obj_binary_ptr(TOS))->x);
+        NOS = new_integer(integer_value(NOS) * integer_value(TOS));
         core_drop();
     } else if(obj_type(NOS) == TYPE_REAL && obj_type(TOS) == TYPE_REAL) {
-        NOS = new_real(
-                ((native_real*)obj_binary_ptr(NOS))->x *
-                ((native_real*)obj_binary_ptr(TOS))->x);
+        NOS = new_real(real_value(NOS) * real_value(TOS));
+        core_drop();
     } else {
-        error(1, 0, "Trying to add types %d and %d",
+        lisp_error("Trying to multiply types %d and %d",
                 obj_type(NOS), obj_type(TOS));
     }
 }
@@ -208,16 +500,13 @@ static void core_mul(void) {
 // ( a b -- a/b )
 static void core_div(void) {
     if (obj_type(NOS) == TYPE_INTEGER && obj_type(TOS) == TYPE_INTEGER) {
-        NOS = new_integer(
-                    ((native_integer*)obj_binary_ptr(NOS))->x /
-                    ((native_integer*)obj_binary_ptr(TOS))->x);
+        NOS = new_integer(integer_value(NOS) / integer_value(TOS));
         core_drop();
     } else if(obj_type(NOS) == TYPE_REAL && obj_type(TOS) == TYPE_REAL) {
-        NOS = new_real(
-                ((native_real*)obj_binary_ptr(NOS))->x /
-                ((native_real*)obj_binary_ptr(TOS))->x);
+        NOS = new_real(real_value(NOS) / real_value(TOS));
+        core_drop();
     } else {
-        error(1, 0, "Trying to add types %d and %d",
+        lisp_error("Trying to divide types %d and %d",
                 obj_type(NOS), obj_type(TOS));
     }
 }
@@ -225,27 +514,24 @@ static void core_div(void) {
 // ( a -- -a )
 static void core_neg(void) {
     if (obj_type(TOS) == TYPE_INTEGER) {
-        TOS = new_integer(-((native_integer*)obj_binary_ptr(TOS))->x);
+        TOS = new_integer(-integer_value(TOS));
     } else if (obj_type(TOS) == TYPE_REAL) {
-        TOS = new_real(-((native_real*)obj_binary_ptr(TOS))->x);
+        TOS = new_real(-real_value(TOS));
     } else {
-        error(1, 0, "Trying to negate type %dd", obj_type(TOS));
+        lisp_error("Trying to negate type %d", obj_type(TOS));
     }
 }
 
 // ( a b -- a<b )
 static void core_lt(void) {
     if (obj_type(NOS) == TYPE_INTEGER && obj_type(TOS) == TYPE_INTEGER) {
-        NOS = new_bool(
-                    ((native_integer*)obj_binary_ptr(NOS))->x <
-                    ((native_integer*)obj_binary_ptr(TOS))->x);
+        NOS = new_bool(integer_value(NOS) < integer_value(TOS));
         core_drop();
     } else if(obj_type(NOS) == TYPE_REAL && obj_type(TOS) == TYPE_REAL) {
-        NOS = new_bool(
-                ((native_real*)obj_binary_ptr(NOS))->x <
-                ((native_real*)obj_binary_ptr(TOS))->x);
+        NOS = new_bool(real_value(NOS) < real_value(TOS));
+        core_drop();
     } else {
-        error(1, 0, "Trying to add types %d and %d",
+        lisp_error("Trying to compare types %d and %d",
                 obj_type(NOS), obj_type(TOS));
     }
 }
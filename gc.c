@@ -2,20 +2,26 @@
 #define __GC_C__
 
 #include <stddef.h>
+#include <stdint.h>
 
 // NOTE: the user should include this file directly, and define the following
-// two functions dealing with the GC roots:
+// function dealing with the GC roots:
 
-// This function should call gc_copy(r, dest, len) for all roots r.
-static void gc_copy_roots(void *dest, size_t *len);
+// This function should call gc_copy(rs, n, dest, len) for all arrays of root
+// pointers rs (of length n) of the heap h.
+struct heap_struct;
+static void gc_copy_roots(struct heap_struct *h, void *dest, size_t *len);
 
-// This function should call gc_relink(rs, n) for all arrays of root pointers
-// rs (of length n).
-static void gc_relink_roots(void);
+// This function is called when the heap can not grow any further, and
+// should not return. The heap is left in a usable state, so it may raise an
+// error which is caught.
+static void gc_out_of_memory(size_t size);
 
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #define MIN(x,y)    (((x)<(y))?(x):(y))
 #define MAX(x,y)    (((x)>(y))?(x):(y))
@@ -24,19 +30,24 @@ static void gc_relink_roots(void);
 // 64-bit specific definitions
 typedef struct obj_struct {
     uint64_t live   : 1;            // set to 1 during GC if already copied
+    uint64_t remembered : 1;        // is the object in the remembered set?
     uint64_t refs   : 1;            // does the object use references?
     uint64_t binary : 1;            // does the object use raw binary data?
-    uint64_t len    : 61;           // number of references (if refs != 0),
-                                    // otherwise len*sizeof(obj*) is the
-                                    // number of bytes used for binary data
+    uint64_t type   : 8;            // type of the object, for the user
+    uint64_t len    : 52;           // number of references (if refs != 0),
+                                    // otherwise the number of bytes used
+                                    // for binary data
     struct obj_struct *ref[0];      // object data starts here.
                                     // during collection, ref[0] in the old
                                     // object will point to the new object.
                                     // see obj_size() below for details on how
                                     // size information is stored.
-} __attribute__((packed)) obj;
+} __attribute__((packed, aligned(8))) obj;
 
-// Any object will be aligned according to this function.
+#define OBJ_LEN_MAX     (((uint64_t)1 << 52) - 1)
+
+// Any object will be aligned according to this function, which is why obj
+// is declared aligned: the header can be read as one word, not byte by byte.
 // Note that this only applies to the start of the object header, the contents
 // start one word (4 or 8 bytes) after the header.
 static inline size_t gc_align(size_t n) {
@@ -46,32 +57,91 @@ static inline size_t gc_align(size_t n) {
 // 32-bit version of the above
 typedef struct obj_struct {
     uint32_t live   : 1;
+    uint32_t remembered : 1;
     uint32_t refs   : 1;
     uint32_t binary : 1;
-    uint32_t len    : 29;
+    uint32_t type   : 5;
+    uint32_t len    : 23;
     struct obj_struct *ref[0];
-} __attribute__((packed)) obj;
+} __attribute__((packed, aligned(4))) obj;
+
+#define OBJ_LEN_MAX     (((uint32_t)1 << 23) - 1)
 
 static inline size_t gc_align(size_t n) {
     return (n + 3) & (~(size_t)3);
 }
 #endif
 
-typedef struct {
-    void *p;                // pointer to heap memory
+// The heap is divided into a nursery, where new objects are allocated, and
+// an old space. A minor collection copies the live objects of the nursery to
+// the old space, a major collection copies all live objects to a new old
+// space. Old objects which may refer to objects in the nursery are kept in
+// the remembered set, whose members are used as roots in minor collections.
+// Large objects, such as the bucket vectors of tables, remember single
+// references instead (see gc_write_ref()), so that a minor collection does
+// not scan all of them after one of them was written.
+//
+// The heap also keeps statistics. The pause histogram counts collections by
+// duration: pauses[0] counts pauses under 1 microsecond, pauses[i] those
+// from 2^(i-1) to 2^i microseconds, and the last bucket all longer ones.
+//
+// Address space for two old spaces of the maximum size is reserved when the
+// heap is created, and memory is only used as the heap grows. After each
+// major collection, the heap size is set to growth times the amount of live
+// data (but at least min_size and at most max_size).
+#define GC_PAUSE_BUCKETS    24
+
+typedef struct heap_struct {
+    void *p;                // pointer to heap memory (old space)
+    void *spare;            // space to copy to in the next major collection
+    size_t reserved;        // bytes of address space for p and spare
     size_t used;            // number of bytes currently used
     size_t size;            // current heap size (bytes)
+    size_t min_size;        // initial and minimum heap size (bytes)
     size_t max_size;        // maximum heap size (bytes)
+    double growth;          // heap size / live data after collection
     size_t last_used;       // number of bytes used after last collection
+    void *young;            // pointer to the nursery
+    size_t young_used;      // number of bytes used in the nursery
+    size_t young_size;      // size of the nursery (bytes)
+    struct obj_struct **remembered;     // the remembered set
+    size_t n_remembered;    // number of objects in the remembered set
+    size_t remembered_size; // number of objects allocated for the set
+    struct remembered_ref *remembered_refs; // remembered references
+    size_t n_remembered_refs;
+    size_t remembered_refs_size;
+    size_t n_allocs;        // number of objects allocated
+    size_t bytes_allocated; // number of bytes allocated
+    size_t n_minor;         // number of minor collections
+    size_t n_major;         // number of major collections
+    size_t peak_used;       // maximum of used + young_used (bytes)
+    size_t bytes_copied;    // number of bytes copied by collections
+    size_t peak_size;       // maximum heap size so far (bytes)
+    size_t n_resizes;       // number of times the heap size changed
+    uint64_t pause_total;   // time spent collecting (nanoseconds)
+    uint64_t pause_max;     // longest collection (nanoseconds)
+    size_t pauses[GC_PAUSE_BUCKETS];    // pause histogram, see above
 } heap;
 
+// Every object has room for at least one reference after its header, which
+// is where gc_forward() stores the new location of the object. This matters
+// for objects without references and with little or no binary data, such as
+// empty vectors.
+#define GC_MIN_SIZE (sizeof(obj) + sizeof(obj*))
+
+static inline size_t gc_min_size(size_t size) {
+    return (size < GC_MIN_SIZE)? GC_MIN_SIZE : size;
+}
+
+// An object holds either len references, len bytes of binary data, or len
+// references followed by a word with the size of the binary data after it.
 // Number of bytes used by object o.
 static inline size_t obj_size(const obj *o) {
     if (o->refs)
         return sizeof(*o) + o->len*sizeof(o) +
             ((o->binary)? sizeof(obj*) + (size_t)(o->ref[o->len]): 0);
     else
-        return sizeof(*o) + o->len;
+        return gc_min_size(sizeof(*o) + o->len);
 }
 
 static inline size_t obj_binary_size(const obj *o) {
@@ -79,76 +149,339 @@ static inline size_t obj_binary_size(const obj *o) {
     else return 0;
 }
 
+// The binary data of o, or the end of the object if it has none.
 static inline void* obj_binary_ptr(obj *o) {
-    if (o->binary) return (o->refs)? o->ref + (o->len + 1) : o->ref;
-    else return NULL;
+    return (o->refs)? o->ref + o->len + o->binary : o->ref;
 }
 
 static inline size_t obj_n_refs(const obj *o) {
     return (o->refs)? o->len : 0;
 }
 
-// Copy the object o to the new heap (at position *len).
-static void gc_copy(obj *o, void *dest, size_t *len) {
-    if (o->live) return;
+// Pointers with any of the two lowest bits set are immediate values rather
+// than references to objects, and are left alone by the collector.
+static inline int gc_is_ref(const obj *o) {
+    return ((uintptr_t)o & 3) == 0;
+}
+
+// Objects larger than this fraction of the nursery are allocated directly
+// in the old space.
+#define GC_LARGE_FRACTION   4
+
+// Objects of at most this many bytes are never large, since the nursery is
+// at least GC_LARGE_FRACTION times as big, see gc_alloc_small().
+#define GC_SMALL_SIZE       0x40
+
+// The heap currently being collected by this thread, and whether the
+// collection is major.
+static __thread heap *gc_heap;
+static __thread int gc_major;
+
+// Is o in the part of the heap being collected?
+static inline int gc_collecting(const obj *o) {
+    const heap *h = gc_heap;
+    if ((void*)o >= h->young && (void*)o < h->young + h->young_size)
+        return 1;
+    return gc_major && (void*)o >= h->p && (void*)o < h->p + h->used;
+}
+
+// Return the new location of o, copying it to the new heap (at position
+// *len) unless it has already been copied. The references of the copy are
+// updated later by gc_scan().
+static inline obj *gc_forward(obj *o, void *dest, size_t *len) {
+    if (!gc_is_ref(o) || !gc_collecting(o)) return o;
+    if (o->live) return o->ref[0];
     const size_t size = obj_size(o);
     obj *new_o = (obj*)(dest + (*len));
     memcpy(new_o, o, size);
+    new_o->remembered = 0;
     o->live = 1;
+    o->ref[0] = new_o;
     *len = gc_align(*len + size);
-    if (o->refs) {
-        size_t i;
-        for (i=0; i<o->len; i++) gc_copy(o->ref[i], dest, len);
+    return new_o;
+}
+
+// Copy the objects referred to by refs, and update the references.
+static void gc_copy(obj **refs, size_t n, void *dest, size_t *len) {
+    size_t i;
+    for (i=0; i<n; i++) refs[i] = gc_forward(refs[i], dest, len);
+}
+
+// Copy the objects referred to by o, and update its references. o->ref is
+// a member of a packed struct, so it is indexed rather than passed to
+// gc_copy().
+static void gc_copy_refs(obj *o, void *dest, size_t *len) {
+    const size_t n = o->len;
+    size_t i;
+    for (i=0; i<n; i++) o->ref[i] = gc_forward(o->ref[i], dest, len);
+}
+
+// Copy everything reachable from the objects in the new heap from position
+// start, until all objects up to *len have been scanned (Cheney's algorithm).
+static void gc_scan(void *dest, size_t start, size_t *len) {
+    size_t scan;
+
+    for (scan=start; scan<*len; ) {
+        obj *o = dest + scan;
+        if (o->refs) gc_copy_refs(o, dest, len);
+        scan = gc_align(scan + obj_size(o));
     }
-    o->ref[0] = new_o;
 }
 
-// Update references after copying to a new heap.
-static inline void gc_relink(obj **refs, size_t len) {
+static void gc_remember(heap *h, obj *o) {
+    if (h->n_remembered == h->remembered_size) {
+        h->remembered_size *= 2;
+        h->remembered = realloc(h->remembered,
+                                h->remembered_size*sizeof(obj*));
+    }
+    h->remembered[h->n_remembered++] = o;
+    o->remembered = 1;
+}
+
+// Reference i of o. o->ref is a member of a packed struct, so references
+// are not remembered by their address.
+typedef struct remembered_ref {
+    obj *o;
+    size_t i;
+} remembered_ref;
+
+static void gc_remember_ref(heap *h, obj *o, size_t i) {
+    if (h->n_remembered_refs == h->remembered_refs_size) {
+        h->remembered_refs_size *= 2;
+        h->remembered_refs = realloc(h->remembered_refs,
+                h->remembered_refs_size*sizeof(remembered_ref));
+    }
+    h->remembered_refs[h->n_remembered_refs].o = o;
+    h->remembered_refs[h->n_remembered_refs].i = i;
+    h->n_remembered_refs++;
+}
+
+static void gc_forget_all(heap *h) {
     size_t i;
-    for (i=0; i<len; i++) refs[i] = refs[i]->ref[0];
+    for (i=0; i<h->n_remembered; i++) h->remembered[i]->remembered = 0;
+    h->n_remembered = 0;
+    h->n_remembered_refs = 0;
 }
 
-// Update references for all objects in the new heap.
-static void gc_relink_heap(void *p, size_t len) {
-    size_t base;
+static inline int gc_is_young(const heap *h, const obj *o) {
+    return (void*)o >= h->young && (void*)o < h->young + h->young_size;
+}
 
-    for (base=0; base<len; ) {
-        obj *o = p + base;
-        if (o->refs) gc_relink(o->ref, o->len);
-        base = gc_align(base + obj_size(o));
+// Write barrier: this must be called when a reference of o is modified,
+// unless o was allocated after the last call to gc_alloc().
+static inline void gc_write(heap *h, obj *o) {
+    if (!o->remembered &&
+        ((void*)o < h->young || (void*)o >= h->young + h->young_size))
+        gc_remember(h, o);
+}
+
+// Objects with more references than this remember single references.
+#define GC_LARGE_REFS   0x20
+
+// Write barrier for reference i of o only, which is cheaper for large
+// objects: the reference is remembered if it refers to the nursery.
+static inline void gc_write_ref(heap *h, obj *o, size_t i) {
+    if (o->len <= GC_LARGE_REFS) {
+        gc_write(h, o);
+    } else if (!o->remembered && !gc_is_young(h, o) &&
+               gc_is_young(h, o->ref[i])) {
+        gc_remember_ref(h, o, i);
     }
 }
 
-static void gc_create_heap(heap *h, size_t size, size_t max_size) {
-    h->p = malloc(size);
+static void *gc_reserve(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) gc_out_of_memory(size);
+    return p;
+}
+
+static void gc_create_heap(heap *h, size_t size, size_t max_size,
+                           size_t young_size, double growth) {
+    // A major collection may have to copy a full old space and nursery.
+    h->reserved = gc_align(max_size + young_size);
+    h->p = gc_reserve(h->reserved);
+    h->spare = gc_reserve(h->reserved);
     h->used = 0;
-    h->size = size;
+    h->size = MIN(size, max_size);
+    h->min_size = h->size;
     h->max_size = max_size;
-    h->last_used = size;
+    h->growth = MAX(growth, 1.0);
+    h->last_used = 0;
+    young_size = MAX(young_size, GC_LARGE_FRACTION*GC_SMALL_SIZE);
+    h->young = malloc(young_size);
+    h->young_used = 0;
+    h->young_size = young_size;
+    h->remembered_size = 0x100;
+    h->remembered = malloc(h->remembered_size*sizeof(obj*));
+    h->n_remembered = 0;
+    h->remembered_refs_size = 0x100;
+    h->remembered_refs = malloc(h->remembered_refs_size*
+                                sizeof(remembered_ref));
+    h->n_remembered_refs = 0;
+    h->n_allocs = 0;
+    h->bytes_allocated = 0;
+    h->n_minor = 0;
+    h->n_major = 0;
+    h->peak_used = 0;
+    h->bytes_copied = 0;
+    h->peak_size = h->size;
+    h->n_resizes = 0;
+    h->pause_total = 0;
+    h->pause_max = 0;
+    memset(h->pauses, 0, sizeof(h->pauses));
+}
+
+static void gc_destroy_heap(heap *h) {
+    munmap(h->p, h->reserved);
+    munmap(h->spare, h->reserved);
+    free(h->young);
+    free(h->remembered);
+    free(h->remembered_refs);
+}
+
+static uint64_t gc_time(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+// Record a collection which started at gc_time() = start.
+static void gc_pause(heap *h, uint64_t start) {
+    const uint64_t t = gc_time() - start;
+    uint64_t us;
+    size_t i;
+    h->pause_total += t;
+    h->pause_max = MAX(h->pause_max, t);
+    for (i=0, us=t/1000; us && i<GC_PAUSE_BUCKETS-1; i++) us >>= 1;
+    h->pauses[i]++;
 }
 
-static void gc_collect(heap *h) {
-    size_t new_size = MIN(h->max_size,
-                          MAX(h->size, gc_align(3*h->last_used/2)));
+// The amount of memory in use only grows between collections, so this is
+// called before each collection (and when the peak is reported).
+static void gc_update_peak(heap *h) {
+    h->peak_used = MAX(h->peak_used, h->used + h->young_used);
+}
+
+// Major collection, making sure that at least extra bytes are free in the
+// old space afterwards.
+static void gc_collect(heap *h, size_t extra) {
+    const uint64_t start = gc_time();
+    const size_t old_size = h->size;
     size_t len = 0;
-    void *dest = malloc(new_size);
-    gc_copy_roots(dest, &len);
-    gc_relink_heap(dest, len);
-    gc_relink_roots();
-    free(h->p);
+    void *dest = h->spare;
+    gc_update_peak(h);
+    h->n_major++;
+    gc_heap = h;
+    gc_major = 1;
+    gc_copy_roots(h, dest, &len);
+    gc_scan(dest, 0, &len);
+    // Give the memory of the old space back to the system.
+    madvise(h->p, h->used, MADV_DONTNEED);
+    h->spare = h->p;
     h->p = dest;
     h->used = len;
-    h->size = new_size;
     h->last_used = len;
+    h->young_used = 0;
+    h->n_remembered = 0;
+    h->n_remembered_refs = 0;
+    h->size = MAX(h->min_size, gc_align((size_t)(h->growth*(len + extra))));
+    h->size = MIN(h->size, h->max_size);
+    h->bytes_copied += len;
+    if (h->size != old_size) h->n_resizes++;
+    h->peak_size = MAX(h->peak_size, h->size);
+    gc_pause(h, start);
+    if (len + extra > h->max_size) gc_out_of_memory(len + extra);
 }
 
-static obj *gc_alloc(heap *h, size_t size) {
-    while (gc_align(h->used + size) >= h->size) gc_collect(h);
-    obj *o = (obj*)(h->p + h->used);
+// Minor collection, promoting all live objects in the nursery.
+static void gc_collect_minor(heap *h) {
+    if (h->size - h->used < h->young_used) {
+        gc_collect(h, 0);
+        return;
+    }
+    const uint64_t start = gc_time();
+    const size_t promoted = h->used;
+    size_t i;
+    gc_update_peak(h);
+    h->n_minor++;
+    gc_heap = h;
+    gc_major = 0;
+    gc_copy_roots(h, h->p, &h->used);
+    for (i=0; i<h->n_remembered; i++) {
+        obj *o = h->remembered[i];
+        if (o->refs) gc_copy_refs(o, h->p, &h->used);
+    }
+    for (i=0; i<h->n_remembered_refs; i++) {
+        obj *o = h->remembered_refs[i].o;
+        const size_t k = h->remembered_refs[i].i;
+        o->ref[k] = gc_forward(o->ref[k], h->p, &h->used);
+    }
+    gc_scan(h->p, promoted, &h->used);
+    gc_forget_all(h);
+    h->young_used = 0;
+    h->bytes_copied += h->used - promoted;
+    gc_pause(h, start);
+}
+
+// Update the references of all objects in the old space after its contents
+// have been moved there from address from (e.g. loaded from a file).
+static void gc_relocate(heap *h, void *from) {
+    size_t pos, i;
+    for (pos=0; pos<h->used; ) {
+        obj *o = h->p + pos;
+        for (i=0; i<obj_n_refs(o); i++) {
+            if (gc_is_ref(o->ref[i]) && o->ref[i] != NULL)
+                o->ref[i] = (obj*)(h->p + ((void*)o->ref[i] - from));
+        }
+        pos = gc_align(pos + obj_size(o));
+    }
+}
+
+// Allocate size bytes in the old space, e.g. for objects copied from another
+// heap. Any object placed there which refers to the nursery must be
+// remembered with gc_remember().
+static void *gc_alloc_old(heap *h, size_t size) {
+    void *p;
+    h->bytes_allocated += size;
+    if (gc_align(h->used + size) > h->size) gc_collect(h, size);
+    p = h->p + h->used;
     h->used = gc_align(h->used + size);
+    return p;
+}
+
+static obj *gc_alloc(heap *h, size_t size) {
+    obj *o;
+    h->n_allocs++;
+    h->bytes_allocated += size;
+    if (size > h->young_size / GC_LARGE_FRACTION) {
+        if (gc_align(h->used + size) > h->size) gc_collect(h, size);
+        o = (obj*)(h->p + h->used);
+        h->used = gc_align(h->used + size);
+        memset(o, 0, sizeof(obj));
+        gc_remember(h, o);
+        return o;
+    }
+    if (gc_align(h->young_used + size) > h->young_size) gc_collect_minor(h);
+    o = (obj*)(h->young + h->young_used);
+    h->young_used = gc_align(h->young_used + size);
+    memset(o, 0, sizeof(obj));
     return o;
 }
 
-#endif
+// Fast path of gc_alloc() for objects of at most GC_SMALL_SIZE bytes, which
+// always go to the nursery. The header is not cleared, the caller has to
+// write all of it. Inlined with a constant size, this is one compare and
+// one bump of young_used.
+static inline obj *gc_alloc_small(heap *h, size_t size) {
+    const size_t aligned = gc_align(size);
+    obj *o;
+    h->n_allocs++;
+    h->bytes_allocated += size;
+    if (h->young_used + aligned > h->young_size) gc_collect_minor(h);
+    o = (obj*)(h->young + h->young_used);
+    h->young_used += aligned;
+    return o;
+}
 
+#endif
@@ -0,0 +1,197 @@
+#ifndef __IMAGE_C__
+#define __IMAGE_C__
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mem.c"
+
+// An image is a snapshot of the heap after a major collection, so it holds
+// exactly the objects reachable from roots[]. It consists of a header, the
+// names of the natfuns (each followed by a NUL byte) and, at an offset
+// aligned to IMAGE_ALIGN, the contents of the old space.
+//
+// References are stored as they were in memory and relocated when the
+// image is loaded (the header records the address of the old space). Natfun
+// objects hold the index of the natfun in natfuns[] instead of a function
+// pointer, and the names are used to check that the interpreter loading
+// the image registers the same natfuns in the same order.
+
+#define IMAGE_MAGIC     "lisp1k\x04"
+#define IMAGE_ALIGN     0x10000
+
+typedef struct {
+    char magic[8];
+    uint32_t word_size;         // sizeof(obj*)
+    uint32_t n_roots;           // ROOTS_SIZE
+    uint32_t n_natfuns;
+    uint32_t names_size;        // bytes of natfun names
+    uint64_t base;              // address of the old space
+    uint64_t used;              // bytes of heap data
+    uint64_t roots[ROOTS_SIZE];
+} image_header;
+
+static size_t image_data_offset(const image_header *hdr) {
+    size_t n = sizeof(*hdr) + hdr->names_size;
+    return (n + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+// Replace the natfun pointers in the old space by their indices, or the
+// other way round if to_index is zero. The profiler ids and cached global
+// lookups of code objects are not valid in another process, and are cleared.
+// Every natfun is checked before any is converted, so that the heap is left
+// as it was if one can not be.
+static void image_convert(heap *h, int to_index) {
+    size_t pos;
+    for (pos=0; pos<h->used; ) {
+        obj *o = h->p + pos;
+        if (obj_type(o) == TYPE_NATFUN) {
+            native_natfun *nf = obj_binary_ptr(o);
+            if (to_index && natfun_index(nf->x) == n_natfuns) {
+                lisp_error("Can not save unregistered natfun");
+            }
+            if (!to_index && (size_t)nf->x >= n_natfuns) {
+                lisp_error("Invalid natfun in image");
+            }
+        }
+        pos = gc_align(pos + obj_size(o));
+    }
+    for (pos=0; pos<h->used; ) {
+        obj *o = h->p + pos;
+        const native_type type = obj_type(o);
+        if (type == TYPE_NATFUN) {
+            native_natfun *nf = obj_binary_ptr(o);
+            if (to_index)
+                nf->x = (natfun)natfun_index(nf->x);
+            else
+                nf->x = natfuns[(size_t)nf->x].fun;
+        } else if (type == TYPE_CODE) {
+            ((native_code*)obj_binary_ptr(o))->prof_id = 0;
+            code_clear_caches(o);
+        }
+        pos = gc_align(pos + obj_size(o));
+    }
+}
+
+// Write an image of everything reachable from roots[] to the file name. The
+// stack must be empty. Errors are raised with lisp_error().
+static void image_save(const char *name) {
+    heap *h = &vm->heap;
+    image_header hdr;
+    size_t i;
+
+    gc_collect(h, 0);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.word_size = sizeof(obj*);
+    hdr.n_roots = ROOTS_SIZE;
+    hdr.n_natfuns = n_natfuns;
+    for (i=0; i<n_natfuns; i++)
+        hdr.names_size += strlen(natfuns[i].name) + 1;
+    hdr.base = (uintptr_t)h->p;
+    hdr.used = h->used;
+    for (i=0; i<ROOTS_SIZE; i++) hdr.roots[i] = (uintptr_t)vm->roots[i];
+
+    // Natfuns are converted first, since that may raise an error.
+    image_convert(h, 1);
+    FILE *f = fopen(name, "wb");
+    int failed = !f;
+    if (f) {
+        fwrite(&hdr, sizeof(hdr), 1, f);
+        for (i=0; i<n_natfuns; i++)
+            fwrite(natfuns[i].name, strlen(natfuns[i].name) + 1, 1, f);
+        fseek(f, image_data_offset(&hdr), SEEK_SET);
+        fwrite(h->p, 1, h->used, f);
+        failed = ferror(f) | fclose(f);
+    }
+    image_convert(h, 0);
+    if (failed) {
+        lisp_error("Can not write image \"%s\": %s", name, strerror(errno));
+    }
+}
+
+// Close the image file fd and raise an error about the image name, with the
+// description of the error number err unless it is 0.
+__attribute__((noreturn))
+static void image_error(int fd, const char *name, const char *what, int err) {
+    if (fd >= 0) close(fd);
+    if (err) lisp_error("%s \"%s\": %s", what, name, strerror(err));
+    lisp_error("%s \"%s\"", what, name);
+}
+
+// Replace the heap by the image in the file name. The image is mapped into
+// the old space, so only the pages holding references are copied (when
+// they are relocated). Errors are raised with lisp_error().
+static void image_load(const char *name) {
+    heap *h = &vm->heap;
+    image_header hdr;
+    struct stat st;
+    size_t i;
+
+    int fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        image_error(fd, name, "Can not read image", errno);
+    }
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.word_size != sizeof(obj*) || hdr.n_roots != ROOTS_SIZE ||
+        hdr.names_size > IMAGE_ALIGN ||
+        (uint64_t)st.st_size < image_data_offset(&hdr) + hdr.used)
+    {
+        image_error(fd, name, "Invalid image", 0);
+    }
+
+    char names[hdr.names_size + 1], *s = names;
+    if (read(fd, names, hdr.names_size) != (ssize_t)hdr.names_size) {
+        image_error(fd, name, "Invalid image", 0);
+    }
+    names[hdr.names_size] = 0;
+    for (i=0; i<n_natfuns; i++, s+=strlen(s)+1) {
+        if (hdr.n_natfuns != n_natfuns || s >= names + hdr.names_size ||
+            strcmp(s, natfuns[i].name))
+        {
+            image_error(fd, name, "Different natfuns in image", 0);
+        }
+    }
+
+    // Discard the current contents of the heap.
+    if (hdr.used > h->max_size) {
+        close(fd);
+        gc_out_of_memory(hdr.used);
+    }
+    gc_forget_all(h);
+    h->young_used = 0;
+    h->used = 0;
+    if (hdr.used > 0) {
+        void *p = mmap(h->p, hdr.used, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_FIXED, fd, image_data_offset(&hdr));
+        if (p == MAP_FAILED) {
+            image_error(fd, name, "Can not map image", errno);
+        }
+    }
+    close(fd);
+    h->used = hdr.used;
+    h->last_used = hdr.used;
+    h->size = MAX(h->size, gc_align((size_t)(h->growth*hdr.used)));
+    h->size = MIN(h->size, h->max_size);
+    h->peak_size = MAX(h->peak_size, h->size);
+
+    gc_relocate(h, (void*)(uintptr_t)hdr.base);
+    image_convert(h, 0);
+    for (i=0; i<ROOTS_SIZE; i++) {
+        obj *o = (obj*)(uintptr_t)hdr.roots[i];
+        if (gc_is_ref(o) && o != NULL)
+            o = (obj*)(h->p + ((void*)o - (void*)(uintptr_t)hdr.base));
+        vm->roots[i] = o;
+    }
+    vm->n_symbols = 0;
+    for (i=0; i<SYMBOLS->len; i++) {
+        if (SYMBOLS->ref[i] != NIL) vm->n_symbols++;
+    }
+}
+
+#endif
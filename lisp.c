@@ -1,107 +1,167 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "mem.c"
 #include "core.c"
+#include "array.c"
+#include "table.c"
+#include "vm.c"
+#include "pool.c"
+#include "image.c"
 
-// ( -- string )
-void core_token(void) {
-    const size_t max_len = 0x100;
-    size_t len = 0;
-    char buf[max_len];
-    int c;
+// The reader scans tokens in place in its input buffer. A regular file is
+// mapped into memory as a whole; any other input is read in blocks, and the
+// unconsumed part of the buffer is moved to the front before each read (the
+// buffer grows if necessary), so a token is always contiguous in memory.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t pos;                 // start of the current token
+    size_t len;                 // number of bytes in buf
+    size_t size;                // allocated size of buf, 0 if mapped
+    int eof;
+} reader;
 
-    while (isspace(c = getchar()));
-    if (c == EOF) {
-        push(NIL);
-        return;
-    }
-    if (c == '(' || c == ')') {
-        buf[0] = c; buf[1] = 0;
-        push(new_string(buf));
-        return;
-    }
-    if (c == '"') {
-        do {
-            buf[len++] = c;
-            if (len >= max_len-2) {
-                error(1, 0, "Token too long!");
-            }
-            c = getchar();
-        } while (c != EOF && c != '"');
-        if (c == EOF) {
-            push(NIL);
+#define READER_BLOCK_SIZE   0x10000
+
+// The reader of the program run by the current thread.
+static __thread reader *input;
+
+static void reader_open(reader *r, int fd) {
+    struct stat st;
+    r->fd = fd;
+    r->pos = 0;
+    r->eof = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            r->buf = p;
+            r->len = st.st_size;
+            r->size = 0;
+            r->eof = 1;
             return;
         }
-        buf[len++] = c;
-    } else {
-        do {
-            buf[len++] = c;
-            if (len >= max_len-1) {
-                error(1, 0, "Token too long!");
-            }
-            c = getchar();
-        } while (!isspace(c) && c != EOF && c != '(' && c != ')');
+    }
+    r->size = READER_BLOCK_SIZE;
+    r->buf = malloc(r->size);
+    r->len = 0;
+}
 
-        if (c == '(' || c == ')') {
-            ungetc(c, stdin);
+static void reader_close(reader *r) {
+    if (r->size) free(r->buf);
+    else munmap(r->buf, r->len);
+}
+
+// Read until the byte at offset i from the current token is available, and
+// return it, or EOF.
+static int reader_fill(reader *r, size_t i) {
+    while (r->pos + i >= r->len) {
+        if (r->eof) return EOF;
+        if (r->pos > 0) {
+            memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+            r->len -= r->pos;
+            r->pos = 0;
+        }
+        if (r->len == r->size) {
+            r->size *= 2;
+            r->buf = realloc(r->buf, r->size);
         }
+        ssize_t n = read(r->fd, r->buf + r->len, r->size - r->len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error(1, errno, "Error reading input");
+        }
+        if (n == 0) r->eof = 1;
+        r->len += n;
     }
+    return (unsigned char)r->buf[r->pos + i];
+}
 
-    buf[len] = 0;
-    push(new_string(buf));
+static inline int reader_peek(reader *r, size_t i) {
+    if (r->pos + i < r->len) return (unsigned char)r->buf[r->pos + i];
+    return reader_fill(r, i);
 }
 
-// ( string -- atom )
-void core_atom(void) {
-    obj_assert_type(TOS, TYPE_STRING);
-    native_symbol *data = obj_binary_ptr(TOS);
-    char *endptr = NULL;
-
-    if (data->x[0] == '"') {
-        size_t len = strlen(data->x);
-        char buf[len-1];
-        memcpy(buf, data->x + 1, len-2);
-        buf[len-2] = 0;
-        TOS = new_string(buf);
-        return;
-    }
+static int reader_at_end(reader *r) {
+    return r->eof && r->pos == r->len;
+}
 
-    int64_t integer = strtoll(data->x, &endptr, 10);
-    if (*endptr == 0 && data->x[0] != 0) {
-        TOS = new_integer(integer);
-        return;
-    }
+static inline int is_delimiter(int c) {
+    return c == EOF || isspace(c) || c == '(' || c == ')';
+}
 
-    double real = strtod(data->x, &endptr);
-    if (*endptr == 0 && data->x[0] != 0) {
-        TOS = new_real(real);
-        return;
-    }
+// ( -- atom )
+static void core_atom(const char *s, size_t len) {
+    // Only tokens which start like a number are given to strtoll/strtod.
+    size_t i = (s[0] == '+' || s[0] == '-');
+    if (i < len && s[i] == '.') i++;
+    if (i < len && isdigit((unsigned char)s[i])) {
+        // Tokens can be as long as the input, so long ones are copied to
+        // the heap rather than the C stack.
+        char small[64];
+        char *buf = (len < sizeof(small))? small : malloc(len+1);
+        char *endptr;
+        memcpy(buf, s, len);
+        buf[len] = 0;
 
-    TOS = new_symbol(data->x);
+        int64_t integer = strtoll(buf, &endptr, 10);
+        if (*endptr == 0) {
+            if (buf != small) free(buf);
+            push(new_integer(integer));
+            return;
+        }
+
+        double real = strtod(buf, &endptr);
+        if (*endptr == 0) {
+            if (buf != small) free(buf);
+            push(new_real(real));
+            return;
+        }
+        if (buf != small) free(buf);
+    }
+    push(new_symbol_len(s, len));
 }
 
 void core_parse(void);
 
-// ( -- [false/expr::core_parse_rec() true] )
+// ( -- [false/list true] )
+// Parse the rest of a list after the opening parenthesis. The list is built
+// front to back, so the C stack does not grow with the length of the list.
 void core_parse_rec(void) {
-    core_parse();               // [false/nil/expr true]
-    if (TOS == FALSE) return;   // false
-    if (TOS == NIL) {
-        push(TRUE);             // nil true
-        return;
-    }
-    core_drop();                // expr
-    core_parse_rec();           // expr [false/exprs true]
-    if (TOS == FALSE) {
-        core_nip();             // false
-        return;
+    push(NIL);                  // list
+    push(NIL);                  // list last
+    for (;;) {
+        core_parse();           // list last [false/nil/expr true]
+        if (TOS == FALSE) {
+            core_nip();
+            core_nip();         // false
+            return;
+        }
+        if (TOS == NIL) {
+            core_drop();
+            TOS = TRUE;         // list true
+            return;
+        }
+        core_drop();
+        push(NIL);
+        core_cons();            // list last expr::nil
+        if (NOS == NIL) {
+            PICK(2) = TOS;
+        } else {
+            TAIL(NOS) = TOS;
+            gc_write(&vm->heap, NOS);
+        }
+        core_nip();             // list expr::nil
     }
-    core_drop();                // expr exprs
-    core_cons();                // expr::exprs
-    push(TRUE);                 // expr::exprs true
 }
 
 // ( -- [false/nil/expr true] )
@@ -110,23 +170,41 @@ void core_parse_rec(void) {
 //      false   -- unexpected EOF or syntax error
 //      nil     -- unexpected )
 void core_parse(void) {
-    core_token();               // token
-    if (TOS == NIL) {           // nil
-        TOS = FALSE;            // false
-        return;
-    }
+    reader *r = input;
+    size_t len;
+    int c;
 
-    native_symbol *token = obj_binary_ptr(TOS);
-    if (!strcmp(token->x, "(")) {
-        core_drop();
-        core_parse_rec();       // [false/expr true]
-    } else if (!strcmp(token->x, ")")) {
-        core_drop();
-        push(NIL);              // nil
-    } else {
-        core_atom();            // atom
-        push(TRUE);             // atom true
+    while (isspace(c = reader_peek(r, 0))) r->pos++;
+    switch (c) {
+        case EOF:
+            push(FALSE);
+            return;
+        case '(':
+            r->pos++;
+            core_parse_rec();   // [false/expr true]
+            return;
+        case ')':
+            r->pos++;
+            push(NIL);          // nil
+            return;
+        case '"':
+            for (len=1; (c = reader_peek(r, len)) != '"'; len++) {
+                if (c == EOF) {
+                    r->pos = r->len;
+                    push(FALSE);
+                    return;
+                }
+            }
+            push(new_string_len(r->buf + r->pos + 1, len - 1));
+            r->pos += len + 1;
+            break;
+        default:
+            for (len=1; !is_delimiter(reader_peek(r, len)); len++);
+            core_atom(r->buf + r->pos, len);
+            r->pos += len;
+            break;
     }
+    push(TRUE);                 // atom true
 }
 
 void print_expr(obj *o) {
@@ -163,17 +241,58 @@ void print_expr(obj *o) {
                 putchar(')');
                 break;
             case TYPE_INTEGER:
-                printf("%" PRId64 "", ((native_integer*)obj_binary_ptr(o))->x);
+                printf("%" PRId64 "", integer_value(o));
                 break;
             case TYPE_REAL:
-                printf("%g", ((native_real*)obj_binary_ptr(o))->x);
+                printf("%g", real_value(o));
+                break;
+            case TYPE_ENV:
+                printf("<env>");
                 break;
             case TYPE_LAMBDA:
                 putchar('\\');
-                print_expr(o->ref[0]);
+                print_expr(CODE_VARS(LAMBDA_CODE(o)));
                 putchar('.');
-                print_expr(o->ref[1]);
+                print_expr(CODE_BODY(LAMBDA_CODE(o)));
+                break;
+            case TYPE_CODE:
+                printf("<code>");
+                break;
+            case TYPE_FRAME:
+                printf("<frame>");
+                break;
+            case TYPE_MEMO:
+                printf("<memo>");
+                break;
+            case TYPE_HASHTABLE:
+                printf("<table>");
+                break;
+            case TYPE_INT_ARRAY: {
+                size_t i;
+                printf("#i(");
+                for (i=0; i<ARRAY_LEN(o); i++)
+                    printf((i? " %" PRId64 : "%" PRId64), ARRAY_INTS(o)[i]);
+                putchar(')');
                 break;
+            }
+            case TYPE_REAL_ARRAY: {
+                size_t i;
+                printf("#r(");
+                for (i=0; i<ARRAY_LEN(o); i++)
+                    printf(i? " %g" : "%g", ARRAY_REALS(o)[i]);
+                putchar(')');
+                break;
+            }
+            case TYPE_VECTOR: {
+                size_t i;
+                printf("#(");
+                for (i=0; i<VECTOR_LEN(o); i++) {
+                    if (i) putchar(' ');
+                    print_expr(VECTOR_REF(o, i));
+                }
+                putchar(')');
+                break;
+            }
             default:
                 printf("<atom:%d>", obj_type(o));
                 break;
@@ -182,144 +301,23 @@ void print_expr(obj *o) {
 }
 
 // ( expr -- nil )
+// The lock keeps the output of programs running on other threads from
+// ending up in the middle of the expression.
 void core_print(void) {
+    flockfile(stdout);
     print_expr(pop()); putchar('\n');
+    funlockfile(stdout);
     push(NIL);
 }
 
 // ( env expr1 -- expr2 )
+// Compile expr1 and run the resulting code.
 void eval(void) {
-    native_type expr_type = obj_type(TOS);
-    if (expr_type == TYPE_SYMBOL) {
-        core_swap();
-        core_over();
-        core_lookup();
-        if (TOS == FALSE) {
-            error(1, 0, "Unknown symbol: \"%s\"",
-                    ((native_symbol*)obj_binary_ptr(NOS))->x);
-        }
-        core_drop();
-        core_nip();
-        return;
-    } else if (expr_type == TYPE_CONS) {
-        native_symbol *sym = obj_binary_ptr(HEAD(TOS));
-        if (sym->type == TYPE_SYMBOL && !strcmp(sym->x, "lambda")) {
-                                // env lambda::vars::body::nil
-            core_tail();        // env vars::body::nil
-            core_dup();         // env vars::body::nil vars::body::nil
-            core_head();        // env vars::body::nil vars
-            core_swap();        // env vars vars::body::nil
-            core_tail();        // env vars body::nil
-            core_head();        // env vars body
-            core_rot();         // vars body env
-            core_lambda();      // lambda(vars,body,env)
-            return;
-        } else if (sym->type == TYPE_SYMBOL && !strcmp(sym->x, "quote")) {
-            core_nip();
-            TOS = HEAD(TAIL(TOS));
-            return;
-        } else if (sym->type == TYPE_SYMBOL && !strcmp(sym->x, "if")) {
-                                // env if::cond::then::else::nil
-            core_tail();        // env cond::then::else::nil
-            core_over();
-            core_over();
-            core_head();        // env cond::then::else::nil env cond
-            eval();             // env cond::then::else::nil true/false
-            obj_assert_type(TOS, TYPE_BOOL);
-            if (pop() == TRUE) {// env cond::then::else::nil
-                core_tail();    // env then::else::nil
-                core_head();    // env then
-                eval();         // result
-            } else {
-                core_tail();    // env then::else::nil
-                core_tail();    // env else::nil
-                core_head();    // env else
-                eval();         // result
-            }
-            return;
-        } else if (sym->type == TYPE_SYMBOL && !strcmp(sym->x, "define")) {
-                                // env define::var::exp::nil
-            core_tail();        // env var::exp::nil
-            core_dup();
-            core_head();        // env var::exp::nil var
-            core_swap();        // env var var::exp::nil
-            core_tail();        // env var exp::nil
-            core_head();        // env var exp
-            core_swap();        // env exp var
-            core_rot();         // exp var env
-            core_rot();         // var env exp
-            eval();             // var result
-            push(GLOBAL);       // var result global
-            core_rot();
-            core_rot();         // global var result
-            core_extend();      // (var result)::global
-            GLOBAL = pop();
-            push(NIL);
-            return;
-        } else if (sym->type == TYPE_LAMBDA) {
-            core_swap();                // l::args env
-            push(HEAD(NOS)->ref[2]);    // l::args env env'
-            core_append();              // l::args env++env'
-            core_swap();                // env++env' l::args
-
-            push(HEAD(TOS)->ref[0]);    // env l::args vars
-            push(TAIL(NOS));            // env l::args vars args
-            push(PICK(3));              // env l::args vars args env
-            while (NOS != NIL && NNOS != NIL) {
-                push(PICK(4));          // env l::args vars args env env
-                push(HEAD(NNOS));       // env l::args vars args env env arg
-                eval();                 // env l::args vars args env res
-                push(HEAD(PICK(3)));    // env l::args vars args env res var
-                core_swap();            // env l::args vars args env var res
-                core_extend();          // env l::args vars args env
-                NOS = TAIL(NOS);
-                NNOS = TAIL(NNOS);      // env l::args vars args env
-            }
-            core_nip();
-            core_nip();                 // env l::args env'
-            core_swap();
-            core_head();                // env env' lambda(vars,body,env)
-            TOS = TOS->ref[1];          // env env' body
-            core_rot();
-            core_drop();                // env' body
-            eval();
-        } else if (sym->type == TYPE_NATFUN) {
-            core_decons();              // env natfun args
-            size_t base = sptr+1;       // base: env natfun
-            while (TOS != NIL) {        // env natfun args
-                core_decons();          // env natfun arg args
-                core_swap();
-                push(stack[base+1]);    // env natfun args arg env
-                core_swap();            // env natfun args env arg
-                eval();                 // env natfun args res1
-                core_swap();            // env natfun res1 [...] args
-            }
-            core_drop();                // env natfun res1 [...]
-            push(stack[base]);          // env natfun res1 [...] natfun
-            core_execute();             // env natfun retval
-            core_nip();
-            core_nip();                 // retval
-        } else {
-            core_over();                // env fun::args env
-            push(HEAD(NOS));            // env fun::args env fun
-            eval();                     // env fun::args fun'
-            if (obj_type(TOS) != TYPE_LAMBDA && obj_type(TOS) != TYPE_NATFUN)
-            {
-                error(1, 0, "Trying to evaluate type %d\n", obj_type(TOS));
-            }
-            core_swap();
-            core_tail();                // env fun' args
-            core_cons();                // env fun'::args
-            //printf("env = "); print_expr(NOS);
-            //printf("\nexpr = "); print_expr(TOS);
-            //putchar('\n');
-            eval();
-        }
-        return;
-    } else {
-        core_nip();                 // expr1
-        return;
-    }
+    obj_assert_type(NOS, TYPE_ENV);
+    push(NIL);
+    core_swap();
+    compile_code(NULL);
+    core_run();
 }
 
 // ( -- map )
@@ -330,22 +328,125 @@ void core_global(void) {
 // ( map -- )
 void core_setglobal(void) {
     GLOBAL = pop();
+    env_changed();
+}
+
+// Memory management statistics, as reported by gc-stats and on exit.
+typedef struct {
+    const char *name;
+    uint64_t value;
+} heap_stat;
+
+#define N_HEAP_STATS    12
+
+static void heap_stats(heap *h, heap_stat *st) {
+    gc_update_peak(h);
+    st[0]  = (heap_stat){"allocations",        h->n_allocs};
+    st[1]  = (heap_stat){"bytes-allocated",    h->bytes_allocated};
+    st[2]  = (heap_stat){"bytes-copied",       h->bytes_copied};
+    st[3]  = (heap_stat){"minor-collections",  h->n_minor};
+    st[4]  = (heap_stat){"major-collections",  h->n_major};
+    st[5]  = (heap_stat){"pause-total-us",     h->pause_total / 1000};
+    st[6]  = (heap_stat){"pause-max-us",       h->pause_max / 1000};
+    st[7]  = (heap_stat){"used",               h->used + h->young_used};
+    st[8]  = (heap_stat){"used-peak",          h->peak_used};
+    st[9]  = (heap_stat){"heap-size",          h->size};
+    st[10] = (heap_stat){"heap-size-peak",     h->peak_size};
+    st[11] = (heap_stat){"heap-resizes",       h->n_resizes};
+}
+
+// ( -- stats )
+// The statistics as a list of (name . value) pairs, followed by
+// (pause-histogram count0 count1 ...).
+void core_gc_stats(void) {
+    heap_stat st[N_HEAP_STATS];
+    size_t pauses[GC_PAUSE_BUCKETS];
+    size_t i;
+    // Take a snapshot, since building the list may cause collections.
+    heap_stats(&vm->heap, st);
+    memcpy(pauses, vm->heap.pauses, sizeof(pauses));
+
+    push(NIL);
+    for (i=GC_PAUSE_BUCKETS; i>0; i--) {
+        push(new_integer(pauses[i-1]));
+        core_swap();
+        core_cons();
+    }
+    push(new_symbol("pause-histogram"));
+    core_swap();
+    core_cons();
+    push(NIL);
+    core_cons();
+    for (i=N_HEAP_STATS; i>0; i--) {
+        push(new_symbol(st[i-1].name));
+        push(new_integer(st[i-1].value));
+        core_cons();
+        core_swap();
+        core_cons();
+    }
 }
 
 #define DEFINE_NATFUN(name,fun) \
+    register_natfun(name, fun); \
     push(new_symbol(name)); \
     push(new_natfun(fun)); \
-    core_extend();
+    core_define();
+
+// Runtime options, which can be given as environment variables or on the
+// command line (see usage() below).
+typedef struct {
+    size_t heap_size;
+    size_t heap_max;
+    double heap_growth;
+    size_t nursery_size;
+    size_t stack_size;
+    size_t workers;                 // number of threads for pmap
+    int stats;
+    const char *profile;            // file for the profile report, or NULL
+    const char *profile_collapsed;  // file for collapsed stacks, or NULL
+    const char *image;              // image to start from, or NULL
+    const char *save_image;         // image to write at the end, or NULL
+} options;
+
+#ifdef __LP64__
+#define DEFAULT_HEAP_MAX    0x40000000
+#else
+#define DEFAULT_HEAP_MAX    0x10000000
+#endif
+
+static options default_options = {
+    .heap_size      = 0x100000,
+    .heap_max       = DEFAULT_HEAP_MAX,
+    .heap_growth    = 2.0,
+    .nursery_size   = 0x40000,
+    .stack_size     = DEFAULT_STACK_SIZE,
+    .workers        = 0,            // one per processor
+    .stats          = 0,
+    .profile        = NULL,
+    .profile_collapsed = NULL,
+    .image          = NULL,
+    .save_image     = NULL
+};
 
-static void initialize(void) {
-    gc_create_heap(&main_heap, 0x1000, 0x100000);
+// Create an interpreter with the natfuns bound in its global environment,
+// and make it the interpreter of the current thread.
+static void interp_create(const options *opt) {
+    vm = calloc(1, sizeof(interp));
+    vm->env_version = 1;
+    stack_create(opt->stack_size);
+    gc_create_heap(&vm->heap, opt->heap_size, opt->heap_max,
+                   opt->nursery_size, opt->heap_growth);
 
-    roots[ROOT_NIL]     = new_nil();
-    roots[ROOT_TRUE]    = new_bool(1);
-    roots[ROOT_FALSE]   = new_bool(0);
-    roots[ROOT_GLOBAL]  = NIL;
+    size_t i;
+    for (i=0; i<ROOTS_SIZE; i++) vm->roots[i] = NIL;
+    symbols_resize(0x100);
+    vm->roots[ROOT_LAMBDA]  = new_symbol("lambda");
+    vm->roots[ROOT_QUOTE]   = new_symbol("quote");
+    vm->roots[ROOT_IF]      = new_symbol("if");
+    vm->roots[ROOT_DEFINE]  = new_symbol("define");
 
     push(GLOBAL);
+    core_env(0x20);
     DEFINE_NATFUN("cons",       core_cons);
     DEFINE_NATFUN("head",       core_head);
     DEFINE_NATFUN("tail",       core_tail);
@@ -361,12 +462,220 @@ static void initialize(void) {
     DEFINE_NATFUN("global",     core_global);
     DEFINE_NATFUN("global!",    core_setglobal);
     DEFINE_NATFUN("eval",       eval);
+    DEFINE_NATFUN("catch",      core_catch);
+    DEFINE_NATFUN("pmap",       core_pmap);
+    DEFINE_NATFUN("memoize",    core_memoize);
+    DEFINE_NATFUN("memoize-lru", core_memoize_lru);
     DEFINE_NATFUN("print",      core_print);
+    DEFINE_NATFUN("gc-stats",   core_gc_stats);
+    DEFINE_NATFUN("make-vector",    core_make_vector);
+    DEFINE_NATFUN("vector-ref",     core_vector_ref);
+    DEFINE_NATFUN("vector-set!",    core_vector_set);
+    DEFINE_NATFUN("vector-length",  core_vector_length);
+    DEFINE_NATFUN("list->vector",   core_list_vector);
+    DEFINE_NATFUN("vector->list",   core_vector_list);
+    DEFINE_NATFUN("make-array",     core_make_array);
+    DEFINE_NATFUN("array-ref",      core_array_ref);
+    DEFINE_NATFUN("array-set!",     core_array_set);
+    DEFINE_NATFUN("array-length",   core_array_length);
+    DEFINE_NATFUN("list->array",    core_list_array);
+    DEFINE_NATFUN("array->list",    core_array_list);
+    DEFINE_NATFUN("array+",         core_array_add);
+    DEFINE_NATFUN("array*",         core_array_mul);
+    DEFINE_NATFUN("array/",         core_array_div);
+    DEFINE_NATFUN("array<",         core_array_lt);
+    DEFINE_NATFUN("array-sum",      core_array_sum);
+    DEFINE_NATFUN("array-dot",      core_array_dot);
+    DEFINE_NATFUN("array-map",      core_array_map);
+    DEFINE_NATFUN("make-table",     core_make_table);
+    DEFINE_NATFUN("table-get",      core_table_get);
+    DEFINE_NATFUN("table-put!",     core_table_put);
+    DEFINE_NATFUN("table-remove!",  core_table_remove);
+    DEFINE_NATFUN("table-count",    core_table_count);
+    DEFINE_NATFUN("table->list",    core_table_list);
     GLOBAL = pop();
 }
 
-int main(void) {
-    initialize();
+// Print memory management statistics to stderr, one "name value" pair per
+// line (this format is read by bench/run.sh).
+static void print_stats(void) {
+    heap_stat st[N_HEAP_STATS];
+    size_t i;
+    heap_stats(&vm->heap, st);
+    for (i=0; i<N_HEAP_STATS; i++)
+        fprintf(stderr, "%s %" PRIu64 "\n", st[i].name, st[i].value);
+    fprintf(stderr, "pause-histogram");
+    for (i=0; i<GC_PAUSE_BUCKETS; i++)
+        fprintf(stderr, " %zu", vm->heap.pauses[i]);
+    fprintf(stderr, "\n");
+}
+
+static const char *profile_file, *profile_collapsed_file;
+
+static FILE *open_output(const char *name) {
+    if (!strcmp(name, "-")) return stderr;
+    FILE *f = fopen(name, "w");
+    if (!f) error(0, errno, "Can not write \"%s\"", name);
+    return f;
+}
+
+static void close_output(FILE *f) {
+    if (f != stderr) fclose(f);
+}
+
+static void write_profile(void) {
+    FILE *f;
+    prof_stop();
+    if (profile_file && (f = open_output(profile_file))) {
+        prof_write_report(f);
+        close_output(f);
+    }
+    if (profile_collapsed_file && (f = open_output(profile_collapsed_file))) {
+        prof_write_collapsed(f);
+        close_output(f);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+"Usage: %s [options] [PROGRAM.lisp...]\n"
+"\n"
+"Without arguments, the program is read from stdin. Otherwise every program\n"
+"is run by its own interpreter, on its own thread, and the options -S, -p,\n"
+"-P and -o are not supported.\n"
+"\n"
+"Options (and the corresponding environment variables):\n"
+"  -s SIZE    initial heap size (LISP_HEAP_SIZE)\n"
+"  -m SIZE    maximum heap size (LISP_HEAP_MAX)\n"
+"  -g FACTOR  heap size relative to live data after collection\n"
+"             (LISP_HEAP_GROWTH)\n"
+"  -n SIZE    nursery size (LISP_NURSERY_SIZE)\n"
+"  -k SIZE    maximum size of the value stack and of the return stack\n"
+"             (LISP_STACK_SIZE)\n"
+"  -w N       number of worker threads for pmap, by default one per\n"
+"             processor (LISP_WORKERS)\n"
+"  -S         print memory management statistics to stderr on exit\n"
+"             (LISP_STATS)\n"
+"  -p FILE    profile the program, and write a report to FILE\n"
+"             (LISP_PROFILE)\n"
+"  -P FILE    profile the program, and write collapsed stacks for flame\n"
+"             graphs to FILE (LISP_PROFILE_COLLAPSED)\n"
+"  -i FILE    start from the image in FILE instead of an empty global\n"
+"             environment (LISP_IMAGE)\n"
+"  -o FILE    write an image to FILE after the whole program has run\n"
+"\n"
+"Sizes are in bytes, optionally followed by k, m or g. A FILE of \"-\" is\n"
+"stderr.\n", name);
+    exit(1);
+}
+
+static size_t parse_size(const char *name, const char *s) {
+    char *endptr;
+    size_t size = strtoull(s, &endptr, 10);
+    switch (tolower(*endptr)) {
+        case 'g': size <<= 10;  // fall through
+        case 'm': size <<= 10;  // fall through
+        case 'k': size <<= 10;
+                  endptr++;
+    }
+    if (*endptr || endptr == s || !size) {
+        error(1, 0, "Invalid size for %s: \"%s\"", name, s);
+    }
+    return size;
+}
+
+static size_t parse_count(const char *name, const char *s) {
+    char *endptr;
+    size_t n = strtoull(s, &endptr, 10);
+    if (*endptr || endptr == s || !n) {
+        error(1, 0, "Invalid number for %s: \"%s\"", name, s);
+    }
+    return n;
+}
+
+static double parse_factor(const char *name, const char *s) {
+    char *endptr;
+    double x = strtod(s, &endptr);
+    if (*endptr || endptr == s || !(x >= 1.0)) {
+        error(1, 0, "Invalid factor for %s (must be at least 1): \"%s\"",
+              name, s);
+    }
+    return x;
+}
+
+static void parse_options(options *opt, int argc, char **argv) {
+    const char *s;
+    int c;
+
+    *opt = default_options;
+    if ((s = getenv("LISP_HEAP_SIZE")))
+        opt->heap_size = parse_size("LISP_HEAP_SIZE", s);
+    if ((s = getenv("LISP_HEAP_MAX")))
+        opt->heap_max = parse_size("LISP_HEAP_MAX", s);
+    if ((s = getenv("LISP_HEAP_GROWTH")))
+        opt->heap_growth = parse_factor("LISP_HEAP_GROWTH", s);
+    if ((s = getenv("LISP_NURSERY_SIZE")))
+        opt->nursery_size = parse_size("LISP_NURSERY_SIZE", s);
+    if ((s = getenv("LISP_STACK_SIZE")))
+        opt->stack_size = parse_size("LISP_STACK_SIZE", s);
+    if ((s = getenv("LISP_WORKERS")))
+        opt->workers = parse_count("LISP_WORKERS", s);
+    if ((s = getenv("LISP_STATS")) && *s)
+        opt->stats = 1;
+    if ((s = getenv("LISP_PROFILE")) && *s)
+        opt->profile = s;
+    if ((s = getenv("LISP_PROFILE_COLLAPSED")) && *s)
+        opt->profile_collapsed = s;
+    if ((s = getenv("LISP_IMAGE")) && *s)
+        opt->image = s;
+
+    while ((c = getopt(argc, argv, "s:m:g:n:k:w:Sp:P:i:o:")) != -1) {
+        switch (c) {
+            case 's': opt->heap_size = parse_size("-s", optarg); break;
+            case 'm': opt->heap_max = parse_size("-m", optarg); break;
+            case 'g': opt->heap_growth = parse_factor("-g", optarg); break;
+            case 'n': opt->nursery_size = parse_size("-n", optarg); break;
+            case 'k': opt->stack_size = parse_size("-k", optarg); break;
+            case 'w': opt->workers = parse_count("-w", optarg); break;
+            case 'S': opt->stats = 1; break;
+            case 'p': opt->profile = optarg; break;
+            case 'P': opt->profile_collapsed = optarg; break;
+            case 'i': opt->image = optarg; break;
+            case 'o': opt->save_image = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc && (opt->stats || opt->profile ||
+                           opt->profile_collapsed || opt->save_image))
+        usage(argv[0]);
+}
+
+// Run the program read from fd in the interpreter of the current thread,
+// after loading the image load_image, and write an image to save_image if
+// it runs to the end (either image can be NULL). Return 1 if there was an
+// error, which is reported (after the name of the program unless it is
+// NULL), or 0 otherwise.
+static int run(const char *name, int fd, const char *load_image,
+               const char *save_image) {
+    reader r;
+    catch_frame c;
+    reader_open(&r, fd);
+    input = &r;
+    c.prev = NULL;
+    c.sptr = vm->sptr;
+    c.rptr = vm->rptr;
+    if (setjmp(c.env)) {
+        vm->catcher = NULL;
+        vm->sptr = c.sptr;
+        stack_popped();
+        vm->rptr = c.rptr;
+        reader_close(&r);
+        if (name) error(0, 0, "%s: %s", name, c.message);
+        else error(0, 0, "%s", c.message);
+        return 1;
+    }
+    vm->catcher = &c;
+    if (load_image) image_load(load_image);
 
     for (;;) {
         core_parse();
@@ -380,13 +689,86 @@ int main(void) {
             core_drop();
             //printf("result: "); print_expr(pop()); putchar('\n');
         } else {
-            if (!feof(stdin)) {
+            if (TOS == NIL || !reader_at_end(&r)) {
                 printf("Error!\n");
+            } else if (save_image) {
+                vm->sptr = vm->stack_size;
+                stack_popped();
+                image_save(save_image);
             }
             break;
         }
     }
 
+    vm->catcher = NULL;
+    reader_close(&r);
     return 0;
 }
 
+typedef struct {
+    const options *opt;
+    const char *name;
+    pthread_t thread;
+    int status;
+} program;
+
+static void *run_program(void *arg) {
+    program *p = arg;
+    int fd = open(p->name, O_RDONLY);
+    if (fd < 0) {
+        error(0, errno, "Can not read \"%s\"", p->name);
+        p->status = 1;
+        return NULL;
+    }
+    interp_create(p->opt);
+    p->status = run(p->name, fd, p->opt->image, NULL);
+    close(fd);
+    interp_destroy();
+    eq_stack_free();
+    return NULL;
+}
+
+// The interpreters of the pmap workers are made with the same options.
+static options worker_options;
+
+static void create_worker(void) {
+    interp_create(&worker_options);
+}
+
+int main(int argc, char **argv) {
+    options opt;
+    parse_options(&opt, argc, argv);
+    worker_options = opt;
+    pool_init(opt.workers? opt.workers : (size_t)sysconf(_SC_NPROCESSORS_ONLN),
+              create_worker);
+
+    if (optind < argc) {
+        const int n = argc - optind;
+        program programs[n];
+        int i, status = 0;
+        for (i=0; i<n; i++) {
+            programs[i].opt = &opt;
+            programs[i].name = argv[optind + i];
+            int err = pthread_create(&programs[i].thread, NULL, run_program,
+                                     &programs[i]);
+            if (err) {
+                error(1, err, "Can not create thread");
+            }
+        }
+        for (i=0; i<n; i++) {
+            pthread_join(programs[i].thread, NULL);
+            status |= programs[i].status;
+        }
+        return status;
+    }
+
+    interp_create(&opt);
+    if (opt.stats) atexit(print_stats);
+    if (opt.profile || opt.profile_collapsed) {
+        profile_file = opt.profile;
+        profile_collapsed_file = opt.profile_collapsed;
+        atexit(write_profile);
+        prof_start();
+    }
+    return run(NULL, STDIN_FILENO, opt.image, opt.save_image);
+}
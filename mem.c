@@ -2,26 +2,80 @@
 #define __MEM_C__
 
 #include <error.h>
+#include <errno.h>
 #include <alloca.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "gc.c"
 
 typedef void (*natfun)(void);
 
-#define STACK_SIZE  0x1000
-
-obj *stack[STACK_SIZE];
-size_t sptr = STACK_SIZE;
+// Errors which leave the heap in a consistent state are raised with
+// lisp_error(). They can be caught with catch (see core_catch() in vm.c),
+// which sets up a catch_frame; otherwise they end the program like error().
+typedef struct catch_frame {
+    jmp_buf env;
+    struct catch_frame *prev;
+    size_t sptr, rptr;          // stack pointers to restore
+    size_t prof_depth;          // profiler depth to restore
+    char message[0x100];
+} catch_frame;
 
 enum {
-    ROOT_NIL    = 0,
-    ROOT_TRUE,
-    ROOT_FALSE,
-    ROOT_GLOBAL,
+    ROOT_GLOBAL = 0,
+    ROOT_SYMBOLS,
+    ROOT_LAMBDA,
+    ROOT_QUOTE,
+    ROOT_IF,
+    ROOT_DEFINE,
     ROOTS_SIZE
 };
 
-obj *roots[ROOTS_SIZE];
+#define DEFAULT_STACK_SIZE  0x800000
+
+// All the state of an interpreter. There can be any number of interpreters,
+// each with its own heap, and a thread runs at most one of them at a time:
+// vm is the interpreter of the current thread. The heap comes first, so the
+// callbacks of the collector can find the interpreter from the heap.
+typedef struct {
+    heap heap;
+    // Both stacks grow down from the end of a region reserved by
+    // stack_create(), so only the pages which have been used take memory.
+    // The page below each region is a guard page.
+    obj **stack;
+    size_t stack_size;          // number of entries of each stack
+    size_t sptr;
+    size_t stack_mark;          // see stack_changed()
+    // The return stack holds the program counters and frame pointers of the
+    // virtual machine (see vm.c), which are not objects.
+    size_t *rstack;
+    size_t rptr;
+    obj *roots[ROOTS_SIZE];
+    size_t n_symbols;           // number of symbols in SYMBOLS
+    catch_frame *catcher;       // innermost catch, or NULL
+    uint64_t env_version;       // incremented by every define, see core.c
+} interp;
+
+static __thread interp *vm;
+
+__attribute__((noreturn, format(printf, 1, 2)))
+static void lisp_error(const char *format, ...) {
+    char message[sizeof(((catch_frame*)0)->message)];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+    if (vm->catcher) {
+        memcpy(vm->catcher->message, message, sizeof(message));
+        longjmp(vm->catcher->env, 1);
+    }
+    error(1, 0, "%s", message);
+    exit(1);
+}
 
 typedef enum {
     TYPE_NATFUN = 0,
@@ -32,164 +86,507 @@ typedef enum {
     TYPE_SYMBOL,
     TYPE_STRING,
     TYPE_BOOL,
-    TYPE_NIL
+    TYPE_NIL,
+    TYPE_ENV,
+    TYPE_CODE,
+    TYPE_FRAME,
+    TYPE_VECTOR,
+    TYPE_INT_ARRAY,
+    TYPE_REAL_ARRAY,
+    TYPE_MEMO,
+    TYPE_HASHTABLE
 } native_type;
 
+// The type of an object is stored in its header (see obj in gc.c), and its
+// binary data, if any, is one of the structures below. Conses, lambdas,
+// frames and vectors only have references.
+
 typedef struct {
-    native_type type;
     natfun x;
 } __attribute__((packed)) native_natfun;
 
 typedef struct {
-    native_type type;
     int64_t x;
 } __attribute__((packed)) native_integer;
 
 typedef struct {
-    native_type type;
     double x;
 } __attribute__((packed)) native_real;
 
 typedef struct {
-    native_type type;
+    uint32_t hash;              // hash_bytes() of x, cached for lookups
     char x[];
 } __attribute__((packed)) native_symbol;
 
+// An environment frame has two references: the parent frame (or nil) and a
+// table of 2*capacity references holding (key, value) pairs, where unused
+// slots have nil as key. The capacity is always a power of two.
+typedef struct {
+    uint64_t count;             // number of bindings in this frame
+} __attribute__((packed)) native_env;
+
+// A compiled expression has the references (vars, body, name, const0, ...),
+// where vars and body are the source of the lambda (vars is nil for top-level
+// expressions) and name is the first symbol a lambda of this code was bound
+// to by define (or nil), followed by the constant table used by the bytecode.
+// Each constant is followed by the inline cache of the global lookups of it:
+// the value found, and the env_version (a fixnum) of the interpreter at the
+// time it was looked up, or nil. The caches are cleared when code is copied
+// to another interpreter.
+typedef struct {
+    uint32_t n_vars;            // length of the vars list
+    uint32_t depth;             // number of lambdas enclosing the code
+    uint32_t prof_id;           // function id used by the profiler, or 0
+    uint32_t flat;              // the arguments stay on the stack (vm.c)
+    uint8_t x[];                // bytecode, see vm.c
+} __attribute__((packed)) native_code;
+
+// When a lambda is called, its arguments are stored in a frame with the
+// references (parent, arg1, ..., argn), where parent is the environment of
+// the lambda. Frames are only created by the virtual machine, the outermost
+// parent is always an environment. Lambdas which contain no lambdas can
+// not capture their frame, so they are called without one (see vm.c).
+
+// A vector has its elements as references. Internal tables of references,
+// like the slots of an environment frame, are vectors too.
+
+// Numeric arrays hold unboxed int64_t or double elements as their binary
+// data, which is aligned to 8 bytes like the object itself.
+
+// Memoized functions and hash tables keep their entries in a vector of
+// buckets, a power of two long, each holding a chain of entries. An entry is
+// a vector (key, value, hash, next, ...), where hash is the obj_hash_deep()
+// of the key as a fixnum and next is the next entry in the chain, or nil.
+
+// A memoized function has the references (fun, buckets, newest, oldest),
+// where newest and oldest are the ends of the list of entries in order of
+// use (only kept if there is a limit). See memo.c.
+typedef struct {
+    uint64_t count;             // number of entries
+    uint64_t limit;             // maximum number of entries, or 0
+} __attribute__((packed)) native_memo;
+
+// A hash table has the references (buckets, old), where old is nil unless
+// the table is being resized, in which case the entries are moved from the
+// old buckets to the new ones a few at a time. See table.c.
+typedef struct {
+    uint64_t count;             // number of entries
+    uint64_t moved;             // number of old buckets moved so far
+} __attribute__((packed)) native_table;
+
+// FNV-1a
+static inline uint32_t hash_bytes(const void *p, size_t len) {
+    const uint8_t *s = p;
+    uint32_t h = 2166136261U;
+    size_t i;
+    for (i=0; i<len; i++) h = (h ^ s[i]) * 16777619U;
+    return h;
+}
+
+// Integers in [FIXNUM_MIN, FIXNUM_MAX] are stored directly in the obj* word
+// with the lowest bit set, and nil, true and false are constants with the
+// two lowest bits set to 10. Neither are allocated on the heap.
+#define FIXNUM_MIN      (INTPTR_MIN >> 1)
+#define FIXNUM_MAX      (INTPTR_MAX >> 1)
+
+#define IMMEDIATE(n)    ((obj*)(((uintptr_t)(n) << 2) | 2))
+
+#define NIL         IMMEDIATE(0)
+#define TRUE        IMMEDIATE(1)
+#define FALSE       IMMEDIATE(2)
+
+static inline int obj_is_fixnum(const obj *o) {
+    return (uintptr_t)o & 1;
+}
+
+static inline obj *make_fixnum(int64_t x) {
+    return (obj*)(((uintptr_t)x << 1) | 1);
+}
+
+static inline int64_t fixnum_value(const obj *o) {
+    return (intptr_t)o >> 1;
+}
+
 static inline native_type obj_type(obj *o) {
-    return *(native_type*)obj_binary_ptr(o);
+    if (!gc_is_ref(o)) {
+        if (obj_is_fixnum(o)) return TYPE_INTEGER;
+        return (o == NIL)? TYPE_NIL : TYPE_BOOL;
+    }
+    return o->type;
+}
+
+// The value of an integer object (fixnum or boxed).
+static inline int64_t integer_value(obj *o) {
+    if (obj_is_fixnum(o)) return fixnum_value(o);
+    return ((native_integer*)obj_binary_ptr(o))->x;
+}
+
+static inline double real_value(obj *o) {
+    return ((native_real*)obj_binary_ptr(o))->x;
 }
 
 static inline void obj_assert_type(obj *o, native_type type) {
     if (obj_type(o) != type)
-        error(1, 0, "Type error (expected %d, found %d)!", type, obj_type(o));
+        lisp_error("Type error (expected %d, found %d)!", type, obj_type(o));
 }
 
-#define RTOS        (rstack[rptr])
-#define RNOS        (rstack[rptr+1])
+#define RTOS        (vm->rstack[vm->rptr])
+#define RNOS        (vm->rstack[vm->rptr+1])
 
-#define PICK(n)     (stack[sptr+(n)])
+#define PICK(n)     (vm->stack[vm->sptr+(n)])
 #define TOS         PICK(0)
 #define NOS         PICK(1)
 #define NNOS        PICK(2)
 
-#define NIL         (roots[ROOT_NIL])
-#define TRUE        (roots[ROOT_TRUE])
-#define FALSE       (roots[ROOT_FALSE])
-#define GLOBAL      (roots[ROOT_GLOBAL])
+#define GLOBAL      (vm->roots[ROOT_GLOBAL])
+#define SYMBOLS     (vm->roots[ROOT_SYMBOLS])
+
+#define SYM_LAMBDA  (vm->roots[ROOT_LAMBDA])
+#define SYM_QUOTE   (vm->roots[ROOT_QUOTE])
+#define SYM_IF      (vm->roots[ROOT_IF])
+#define SYM_DEFINE  (vm->roots[ROOT_DEFINE])
 
 #define HEAD(o)     ((o)->ref[0])
 #define TAIL(o)     ((o)->ref[1])
 
-heap main_heap;
+#define CODE_VARS(o)    ((o)->ref[0])
+#define CODE_BODY(o)    ((o)->ref[1])
+#define CODE_NAME(o)    ((o)->ref[2])
+#define CODE_CONST(o,i) ((o)->ref[3+3*(i)])
+#define CODE_CACHE(o,i) ((o)->ref[4+3*(i)])
+#define CODE_VERSION(o,i) ((o)->ref[5+3*(i)])
+#define CODE_N_CONSTS(o) ((obj_n_refs(o) - 3)/3)
+#define CODE_N_VARS(o)  (((native_code*)obj_binary_ptr(o))->n_vars)
+#define CODE_DEPTH(o)   (((native_code*)obj_binary_ptr(o))->depth)
+#define CODE_PROF_ID(o) (((native_code*)obj_binary_ptr(o))->prof_id)
+#define CODE_FLAT(o)    (((native_code*)obj_binary_ptr(o))->flat)
+#define CODE_BYTES(o)   (((native_code*)obj_binary_ptr(o))->x)
+
+#define NATFUN_FUN(o)   (((native_natfun*)obj_binary_ptr(o))->x)
+
+#define LAMBDA_CODE(o)  ((o)->ref[0])
+#define LAMBDA_ENV(o)   ((o)->ref[1])
+
+#define FRAME_PARENT(o) ((o)->ref[0])
+#define FRAME_ARG(o,i)  ((o)->ref[1+(i)])
+
+#define ENV_PARENT(o)   ((o)->ref[0])
+#define ENV_SLOTS(o)    ((o)->ref[1])
+#define ENV_COUNT(o)    (((native_env*)obj_binary_ptr(o))->count)
+
+#define VECTOR_LEN(o)   obj_n_refs(o)
+#define VECTOR_REF(o,i) ((o)->ref[i])
+
+#define ARRAY_LEN(o)    (obj_binary_size(o) / 8)
+#define ARRAY_INTS(o)   ((int64_t*)obj_binary_ptr(o))
+#define ARRAY_REALS(o)  ((double*)obj_binary_ptr(o))
+
+#define ENTRY_KEY(o)    ((o)->ref[0])
+#define ENTRY_VALUE(o)  ((o)->ref[1])
+#define ENTRY_HASH(o)   ((o)->ref[2])
+#define ENTRY_NEXT(o)   ((o)->ref[3])
+
+#define MEMO_FUN(o)     ((o)->ref[0])
+#define MEMO_BUCKETS(o) ((o)->ref[1])
+#define MEMO_NEWEST(o)  ((o)->ref[2])
+#define MEMO_OLDEST(o)  ((o)->ref[3])
+#define MEMO_COUNT(o)   (((native_memo*)obj_binary_ptr(o))->count)
+#define MEMO_LIMIT(o)   (((native_memo*)obj_binary_ptr(o))->limit)
+
+#define TABLE_BUCKETS(o) ((o)->ref[0])
+#define TABLE_OLD(o)    ((o)->ref[1])
+#define TABLE_COUNT(o)  (((native_table*)obj_binary_ptr(o))->count)
+#define TABLE_MOVED(o)  (((native_table*)obj_binary_ptr(o))->moved)
+
+// Every natfun is registered with its name when it is bound in the global
+// environment (see DEFINE_NATFUN in lisp.c), so it can be identified later.
+#define NATFUNS_SIZE    0x40
+
+typedef struct {
+    const char *name;
+    natfun fun;
+} natfun_entry;
+
+static natfun_entry natfuns[NATFUNS_SIZE];
+static size_t n_natfuns = 0;
+static pthread_mutex_t natfuns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The index of fun in natfuns, or n_natfuns if it is not registered.
+static size_t natfun_index(natfun fun) {
+    size_t i;
+    for (i=0; i<n_natfuns && natfuns[i].fun != fun; i++);
+    return i;
+}
 
-static obj *pop(void) {
-    if (sptr >= STACK_SIZE) {
-        error(1, 0, "Stack underflow");
+// Every interpreter registers the same natfuns, so only the first one
+// changes the table.
+static void register_natfun(const char *name, natfun fun) {
+    pthread_mutex_lock(&natfuns_lock);
+    if (natfun_index(fun) == n_natfuns) {
+        if (n_natfuns == NATFUNS_SIZE) {
+            error(1, 0, "Too many natfuns");
+        }
+        natfuns[n_natfuns].name = name;
+        natfuns[n_natfuns].fun = fun;
+        __sync_synchronize();
+        n_natfuns++;
     }
-    return stack[sptr++];
+    pthread_mutex_unlock(&natfuns_lock);
 }
 
-static void push(obj *o) {
-    if (sptr < 1) {
-        error(1, 0, "Stack overflow");
+static void *stack_reserve(size_t n) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t size = (n + page - 1) & ~(page - 1);
+    void *p = mmap(NULL, page + size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED || mprotect(p, page, PROT_NONE) < 0) {
+        error(1, errno, "Can not reserve %zu bytes of stack", size);
     }
-    stack[--sptr] = o;
+    return p + page + size - n;
 }
 
-static void gc_copy_roots(void *dest, size_t *len) {
-    size_t i;
-    for (i=sptr; i<STACK_SIZE; i++)
-        gc_copy(stack[i], dest, len);
-    for (i=0; i<ROOTS_SIZE; i++)
-        gc_copy(roots[i], dest, len);
+static void stack_release(void *p, size_t n) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t size = (n + page - 1) & ~(page - 1);
+    munmap(p + n - size - page, page + size);
+}
+
+// Reserve a value stack and a return stack of size bytes each.
+static void stack_create(size_t size) {
+    vm->stack_size = size / sizeof(obj*);
+    vm->stack = stack_reserve(vm->stack_size*sizeof(obj*));
+    vm->sptr = vm->stack_size;
+    vm->stack_mark = vm->stack_size;
+    vm->rstack = stack_reserve(vm->stack_size*sizeof(size_t));
+    vm->rptr = vm->stack_size;
+}
+
+// Free all the memory of the interpreter of the current thread.
+static void interp_destroy(void) {
+    stack_release(vm->stack, vm->stack_size*sizeof(obj*));
+    stack_release(vm->rstack, vm->stack_size*sizeof(size_t));
+    gc_destroy_heap(&vm->heap);
+    free(vm);
+    vm = NULL;
+}
+
+// The slots of the value stack from stack_mark up have not changed since
+// the last collection, so they only refer to old objects, and a minor
+// collection does not scan them. The collection sets stack_mark to sptr +
+// STACK_SLACK, and stack_changed() keeps it at least that far above sptr, so
+// the top STACK_SLACK slots (TOS, NOS and so on) can be written freely. Code
+// which pops by setting sptr, or writes a slot deeper down, has to call
+// stack_changed() with the index above the slots it changed. stack_mark is
+// at most stack_size + STACK_SLACK.
+#define STACK_SLACK 0x10
+
+static inline void stack_changed(size_t i) {
+    if (i > vm->stack_mark) vm->stack_mark = i;
+}
+
+static inline void stack_popped(void) {
+    stack_changed(vm->sptr + STACK_SLACK);
 }
 
-static void gc_relink_roots(void) {
-    gc_relink(stack + sptr, STACK_SIZE-sptr);
-    gc_relink(roots, ROOTS_SIZE);
+// Since stack_mark is at most stack_size + STACK_SLACK, a single comparison
+// in pop() finds both an underflow and a pop which has to move stack_mark
+// up. It is moved up by another STACK_SLACK, so that the next pops need not.
+__attribute__((noinline))
+static void pop_slow(void) {
+    if (vm->sptr >= vm->stack_size) {
+        lisp_error("Stack underflow");
+    }
+    vm->stack_mark = MIN(vm->sptr + 2*STACK_SLACK,
+                         vm->stack_size + STACK_SLACK);
+}
+
+static inline obj *pop(void) {
+    if (vm->sptr + STACK_SLACK >= vm->stack_mark) pop_slow();
+    return vm->stack[vm->sptr++];
+}
+
+static inline void push(obj *o) {
+    if (vm->sptr < 1) {
+        lisp_error("Stack overflow");
+    }
+    vm->stack[--vm->sptr] = o;
+}
+
+static inline size_t rpop(void) {
+    if (vm->rptr >= vm->stack_size) {
+        lisp_error("Return stack underflow");
+    }
+    return vm->rstack[vm->rptr++];
+}
+
+static inline void rpush(size_t x) {
+    if (vm->rptr < 1) {
+        lisp_error("Return stack overflow");
+    }
+    vm->rstack[--vm->rptr] = x;
 }
 
-static obj *new_obj(size_t n_refs, size_t binary_size) {
+// Running out of memory only stops the program of this interpreter.
+static void gc_out_of_memory(size_t size) {
+    lisp_error("Out of memory (%zu bytes needed)", size);
+}
+
+static void gc_copy_roots(heap *h, void *dest, size_t *len) {
+    interp *in = (interp*)h;
+    const size_t end = gc_major? in->stack_size :
+        MIN(in->stack_mark, in->stack_size);
+    gc_copy(in->stack + in->sptr, end - in->sptr, dest, len);
+    gc_copy(in->roots, ROOTS_SIZE, dest, len);
+    in->stack_mark = in->sptr + STACK_SLACK;
+}
+
+static obj *new_obj(native_type type, size_t n_refs, size_t binary_size) {
     obj *o;
+    if (n_refs > OBJ_LEN_MAX || (!n_refs && binary_size > OBJ_LEN_MAX)) {
+        lisp_error("Object too large (%zu references, %zu bytes)",
+                n_refs, binary_size);
+    }
     if (n_refs) {
         if (binary_size) {
-            o = gc_alloc(&main_heap,
+            o = gc_alloc(&vm->heap,
                     sizeof(obj) + (n_refs+1)*sizeof(obj*) + binary_size);
             o->ref[n_refs] = (obj*)binary_size;
         } else {
-            o = gc_alloc(&main_heap,
+            o = gc_alloc(&vm->heap,
                     sizeof(obj) + n_refs*sizeof(obj*));
         }
         o->len = n_refs;
     } else {
-        if (binary_size) {
-            o = gc_alloc(&main_heap,
-                    sizeof(obj) + binary_size);
-        } else {
-            return NULL;
-        }
+        o = gc_alloc(&vm->heap, gc_min_size(sizeof(obj) + binary_size));
         o->len = binary_size;
     }
     o->live = 0;
     o->refs = n_refs != 0;
     o->binary = binary_size != 0;
+    o->type = type;
     return o;
 }
 
-static obj *new_obj_fill(size_t n_refs, const void *data, size_t binary_size) {
-    obj *o = new_obj(n_refs, binary_size);
+// Allocate an object of a fixed shape, with either n_refs references or
+// binary_size bytes of binary data (which are not initialized). With
+// constant arguments the size and header fold into constants, so this is
+// much cheaper than new_obj(). The object must not be larger than
+// GC_SMALL_SIZE bytes.
+static inline obj *new_small(native_type type, size_t n_refs,
+                             size_t binary_size) {
+    obj *o;
+    if (n_refs) {
+        o = gc_alloc_small(&vm->heap, sizeof(obj) + n_refs*sizeof(obj*));
+        *o = (obj){.refs = 1, .type = type, .len = n_refs};
+    } else {
+        o = gc_alloc_small(&vm->heap, gc_min_size(sizeof(obj) + binary_size));
+        *o = (obj){.binary = 1, .type = type, .len = binary_size};
+    }
+    return o;
+}
+
+static obj *new_obj_fill(native_type type, size_t n_refs, const void *data,
+                         size_t binary_size) {
+    obj *o = new_obj(type, n_refs, binary_size);
     memcpy(obj_binary_ptr(o), data, binary_size);
     return o;
 }
 
-static obj *new_string(const char *s) {
-    size_t size = sizeof(native_symbol) + strlen(s) + 1;
-    native_symbol *data = alloca(size);
-    data->type = TYPE_STRING;
-    strcpy(data->x, s);
-    return new_obj_fill(0, data, size);
+// Strings and symbols are built from a pointer and a length, so the reader
+// can create them directly from its input buffer.
+static obj *new_string_len(const char *s, size_t len) {
+    obj *o = new_obj(TYPE_STRING, 0, sizeof(native_symbol) + len + 1);
+    native_symbol *data = obj_binary_ptr(o);
+    data->hash = hash_bytes(s, len);
+    memcpy(data->x, s, len);
+    data->x[len] = 0;
+    return o;
+}
+
+// The symbol table is an open addressing hash table of SYMBOLS->len slots,
+// where unused slots contain nil. Every symbol is interned, so symbols can be
+// compared by identity.
+
+static void symbols_resize(size_t len) {
+    obj *table = new_obj(TYPE_VECTOR, len, 0);
+    size_t i;
+    for (i=0; i<len; i++) table->ref[i] = NIL;
+    if (SYMBOLS != NIL) {
+        for (i=0; i<SYMBOLS->len; i++) {
+            obj *sym = SYMBOLS->ref[i];
+            if (sym != NIL) {
+                size_t j = ((native_symbol*)obj_binary_ptr(sym))->hash;
+                while (table->ref[j & (len-1)] != NIL) j++;
+                table->ref[j & (len-1)] = sym;
+            }
+        }
+    }
+    SYMBOLS = table;
+}
+
+static obj *new_symbol_len(const char *s, size_t len) {
+    uint32_t hash = hash_bytes(s, len);
+    size_t mask = SYMBOLS->len - 1;
+    size_t i;
+    for (i=hash&mask; SYMBOLS->ref[i]!=NIL; i=(i+1)&mask) {
+        native_symbol *sym = obj_binary_ptr(SYMBOLS->ref[i]);
+        if (sym->hash == hash && !strncmp(sym->x, s, len) && !sym->x[len])
+            return SYMBOLS->ref[i];
+    }
+
+    obj *o = new_obj(TYPE_SYMBOL, 0, sizeof(native_symbol) + len + 1);
+    native_symbol *data = obj_binary_ptr(o);
+    data->hash = hash;
+    memcpy(data->x, s, len);
+    data->x[len] = 0;
+    push(o);
+    if (2*(vm->n_symbols+1) > SYMBOLS->len) {
+        symbols_resize(2*SYMBOLS->len);
+        mask = SYMBOLS->len - 1;
+    }
+    for (i=hash&mask; SYMBOLS->ref[i]!=NIL; i=(i+1)&mask);
+    SYMBOLS->ref[i] = TOS;
+    gc_write_ref(&vm->heap, SYMBOLS, i);
+    vm->n_symbols++;
+    return pop();
 }
 
 static obj *new_symbol(const char *s) {
-    size_t size = sizeof(native_symbol) + strlen(s) + 1;
-    native_symbol *data = alloca(size);
-    data->type = TYPE_SYMBOL;
-    strcpy(data->x, s);
-    return new_obj_fill(0, data, size);
+    return new_symbol_len(s, strlen(s));
 }
 
 static obj *new_integer(int64_t x) {
-    native_integer data;
-    data.type = TYPE_INTEGER;
-    data.x = x;
-    return new_obj_fill(0, &data, sizeof(data));
+    if (x >= FIXNUM_MIN && x <= FIXNUM_MAX) return make_fixnum(x);
+    obj *o = new_small(TYPE_INTEGER, 0, sizeof(native_integer));
+    ((native_integer*)obj_binary_ptr(o))->x = x;
+    return o;
 }
 
-static obj *new_real(int64_t x) {
-    native_real data;
-    data.type = TYPE_REAL;
-    data.x = x;
-    return new_obj_fill(0, &data, sizeof(data));
+static obj *new_real(double x) {
+    obj *o = new_small(TYPE_REAL, 0, sizeof(native_real));
+    ((native_real*)obj_binary_ptr(o))->x = x;
+    return o;
 }
 
 static obj *new_natfun(natfun x) {
     native_natfun data;
-    data.type = TYPE_NATFUN;
     data.x = x;
-    return new_obj_fill(0, &data, sizeof(data));
+    return new_obj_fill(TYPE_NATFUN, 0, &data, sizeof(data));
 }
 
-static obj *new_nil(void) {
-    native_type type = TYPE_NIL;
-    return new_obj_fill(0, &type, sizeof(type));
+// Hash of an object, consistent with core_eq(): equal objects always have
+// the same type, binary data and number of references.
+static uint32_t obj_hash(obj *o) {
+    if (!gc_is_ref(o)) return hash_bytes(&o, sizeof(o));
+    if (obj_type(o) == TYPE_SYMBOL || obj_type(o) == TYPE_STRING)
+        return ((native_symbol*)obj_binary_ptr(o))->hash;
+    return hash_bytes(obj_binary_ptr(o), obj_binary_size(o)) ^
+           (uint32_t)obj_n_refs(o) ^ ((uint32_t)obj_type(o) << 24);
 }
 
-static obj *new_bool(int x) {
-    native_integer data;
-    data.x = (x != 0);
-    data.type = TYPE_BOOL;
-    return new_obj_fill(0, &data, sizeof(data));
-}   
+static inline obj *new_bool(int x) {
+    return x? TRUE : FALSE;
+}
 
 #endif
 
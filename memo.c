@@ -0,0 +1,250 @@
+#ifndef __MEMO_C__
+#define __MEMO_C__
+
+#include "core.c"
+
+// A memoized function calls a natfun or lambda only the first time it is
+// called with some arguments, and returns the cached result after that. The
+// cache is a hash table of entries keyed by the vector of the arguments,
+// which are compared with obj_equal() and hashed with obj_hash_deep() (see
+// native_memo in mem.c). It is made of heap objects, so the collector traces
+// it like any other.
+//
+// If the number of entries is limited, the least recently used entry is
+// evicted when the limit is exceeded. Otherwise the table keeps growing.
+//
+// The result of a call is only added when the call returns, so a recursive
+// function gets its recursive calls cached as well if it calls itself
+// through the memoized function, as in
+//
+//     (define fib (memoize (lambda (n) ... (fib (- n 1)) ...)))
+
+// The entries of a memoized function have two more references, newer and
+// older, their neighbours in the list of entries in order of use.
+#define ENTRY_NEWER(o)  ((o)->ref[4])
+#define ENTRY_OLDER(o)  ((o)->ref[5])
+#define MEMO_ENTRY_SIZE 6
+
+#define MEMO_MIN_BUCKETS    8
+
+static void core_apply(size_t n);   // see vm.c
+
+// ( arg1 ... argn memo -- arg1 ... argn memo )
+static uint32_t memo_hash(size_t n) {
+    uint32_t h = 2166136261U ^ n;
+    size_t i;
+    for (i=n; i>0; i--) h = (h ^ obj_hash_deep(PICK(i))) * 16777619U;
+    return h;
+}
+
+// ( arg1 ... argn memo -- arg1 ... argn memo )
+// The entry for the arguments, or nil.
+static obj *memo_find(size_t n, uint32_t hash) {
+    obj *buckets = MEMO_BUCKETS(TOS);
+    obj *e = buckets->ref[hash & (VECTOR_LEN(buckets) - 1)];
+    size_t i;
+    for (; e != NIL; e=ENTRY_NEXT(e)) {
+        obj *key = ENTRY_KEY(e);
+        if (ENTRY_HASH(e) != make_fixnum(hash) || VECTOR_LEN(key) != n)
+            continue;
+        for (i=0; i<n; i++) {
+            obj *a = VECTOR_REF(key, i), *b = PICK(n-i);
+            if (a != b && !obj_equal(a, b)) break;
+        }
+        if (i == n) return e;
+    }
+    return NIL;
+}
+
+// Remove e from the list of entries in order of use.
+static void memo_unlink(obj *memo, obj *e) {
+    obj *newer = ENTRY_NEWER(e), *older = ENTRY_OLDER(e);
+    if (newer != NIL) {
+        ENTRY_OLDER(newer) = older;
+        gc_write(&vm->heap, newer);
+    } else {
+        MEMO_NEWEST(memo) = older;
+    }
+    if (older != NIL) {
+        ENTRY_NEWER(older) = newer;
+        gc_write(&vm->heap, older);
+    } else {
+        MEMO_OLDEST(memo) = newer;
+    }
+    gc_write(&vm->heap, memo);
+}
+
+// Make e the most recently used entry.
+static void memo_push(obj *memo, obj *e) {
+    ENTRY_NEWER(e) = NIL;
+    ENTRY_OLDER(e) = MEMO_NEWEST(memo);
+    gc_write(&vm->heap, e);
+    if (MEMO_NEWEST(memo) != NIL) {
+        ENTRY_NEWER(MEMO_NEWEST(memo)) = e;
+        gc_write(&vm->heap, MEMO_NEWEST(memo));
+    } else {
+        MEMO_OLDEST(memo) = e;
+    }
+    MEMO_NEWEST(memo) = e;
+    gc_write(&vm->heap, memo);
+}
+
+// Remove the least recently used entry.
+static void memo_evict(obj *memo) {
+    obj *e = MEMO_OLDEST(memo);
+    obj *buckets = MEMO_BUCKETS(memo);
+    const size_t i = fixnum_value(ENTRY_HASH(e)) & (VECTOR_LEN(buckets) - 1);
+    if (buckets->ref[i] == e) {
+        buckets->ref[i] = ENTRY_NEXT(e);
+        gc_write_ref(&vm->heap, buckets, i);
+    } else {
+        obj *prev = buckets->ref[i];
+        while (ENTRY_NEXT(prev) != e) prev = ENTRY_NEXT(prev);
+        ENTRY_NEXT(prev) = ENTRY_NEXT(e);
+        gc_write(&vm->heap, prev);
+    }
+    memo_unlink(memo, e);
+    MEMO_COUNT(memo)--;
+}
+
+// ( memo -- memo )
+// Double the number of buckets.
+static void memo_resize(void) {
+    const size_t len = VECTOR_LEN(MEMO_BUCKETS(TOS));
+    obj *buckets = new_obj(TYPE_VECTOR, 2*len, 0);
+    obj *old = MEMO_BUCKETS(TOS);
+    size_t i;
+    for (i=0; i<2*len; i++) buckets->ref[i] = NIL;
+    for (i=0; i<len; i++) {
+        obj *e = old->ref[i];
+        while (e != NIL) {
+            obj *next = ENTRY_NEXT(e);
+            const size_t j = fixnum_value(ENTRY_HASH(e)) & (2*len - 1);
+            ENTRY_NEXT(e) = buckets->ref[j];
+            gc_write(&vm->heap, e);
+            buckets->ref[j] = e;
+            e = next;
+        }
+    }
+    MEMO_BUCKETS(TOS) = buckets;
+    gc_write(&vm->heap, TOS);
+}
+
+// ( memo key value -- memo key value )
+static void memo_insert(uint32_t hash) {
+    obj *e = new_small(TYPE_VECTOR, MEMO_ENTRY_SIZE, 0);
+    obj *memo = NNOS;
+    obj *buckets = MEMO_BUCKETS(memo);
+    const size_t i = hash & (VECTOR_LEN(buckets) - 1);
+    ENTRY_KEY(e) = NOS;
+    ENTRY_VALUE(e) = TOS;
+    ENTRY_HASH(e) = make_fixnum(hash);
+    ENTRY_NEXT(e) = buckets->ref[i];
+    ENTRY_NEWER(e) = NIL;
+    ENTRY_OLDER(e) = NIL;
+    buckets->ref[i] = e;
+    gc_write_ref(&vm->heap, buckets, i);
+    MEMO_COUNT(memo)++;
+    if (MEMO_LIMIT(memo)) {
+        memo_push(memo, e);
+        if (MEMO_COUNT(memo) > MEMO_LIMIT(memo)) memo_evict(memo);
+    }
+    if (MEMO_COUNT(memo) > VECTOR_LEN(buckets)) {
+        push(memo);
+        memo_resize();
+        core_drop();
+    }
+}
+
+// ( arg1 ... argn memo -- result ) if the result is cached, returning 1,
+// ( arg1 ... argn memo -- memo key arg1 ... argn fun ) otherwise, returning
+// 0. In the latter case, the result of calling fun is added to the cache by
+// memo_leave().
+static int memo_enter(size_t n, uint32_t hash) {
+    const size_t base = vm->sptr + n;
+    obj *e = memo_find(n, hash);
+    size_t i;
+    if (e != NIL) {
+        if (MEMO_LIMIT(TOS) && MEMO_NEWEST(TOS) != e) {
+            memo_unlink(TOS, e);
+            memo_push(TOS, e);
+        }
+        vm->stack[base] = ENTRY_VALUE(e);
+        vm->sptr = base;
+        stack_popped();
+        return 1;
+    }
+    obj *key = new_obj(TYPE_VECTOR, n, 0);
+    obj *memo = TOS;
+    for (i=0; i<n; i++) VECTOR_REF(key, i) = PICK(n-i);
+    push(NIL);
+    push(NIL);
+    // Move the arguments below memo and key.
+    for (i=n; i>0; i--) vm->stack[base-1-i] = vm->stack[base+1-i];
+    vm->stack[base] = memo;
+    vm->stack[base-1] = key;
+    stack_changed(base + 1);
+    TOS = MEMO_FUN(memo);
+    return 0;
+}
+
+// ( memo key result -- result )
+static void memo_leave(uint32_t hash) {
+    memo_insert(hash);
+    NNOS = TOS;
+    core_drop();
+    core_drop();
+}
+
+// ( arg1 ... argn memo -- result )
+// Call the memoized function with n arguments. The virtual machine runs
+// memoized lambdas itself (see OP_CALL in vm.c), so that a recursive
+// function does not recurse on the C stack.
+static void memo_call(size_t n) {
+    const uint32_t hash = memo_hash(n);
+    if (memo_enter(n, hash)) return;
+    core_apply(n);              // memo key result
+    memo_leave(hash);
+}
+
+// ( fun limit -- memo )
+// Create a memoized function, which keeps at most limit results if limit
+// is not zero.
+static void memo_create(void) {
+    native_memo data;
+    size_t i;
+    if (obj_type(NOS) != TYPE_NATFUN && obj_type(NOS) != TYPE_LAMBDA &&
+        obj_type(NOS) != TYPE_MEMO)
+    {
+        lisp_error("Can not memoize type %d", obj_type(NOS));
+    }
+    data.count = 0;
+    data.limit = integer_value(TOS);
+    obj *buckets = new_obj(TYPE_VECTOR, MEMO_MIN_BUCKETS, 0);
+    for (i=0; i<MEMO_MIN_BUCKETS; i++) buckets->ref[i] = NIL;
+    TOS = buckets;
+    obj *o = new_obj_fill(TYPE_MEMO, 4, &data, sizeof(data));
+    MEMO_FUN(o) = NOS;
+    MEMO_BUCKETS(o) = TOS;
+    MEMO_NEWEST(o) = NIL;
+    MEMO_OLDEST(o) = NIL;
+    core_drop();
+    TOS = o;
+}
+
+// ( fun -- memo )
+static void core_memoize(void) {
+    push(make_fixnum(0));
+    memo_create();
+}
+
+// ( fun limit -- memo )
+static void core_memoize_lru(void) {
+    obj_assert_type(TOS, TYPE_INTEGER);
+    if (integer_value(TOS) <= 0) {
+        lisp_error("Invalid memoize limit %" PRId64, integer_value(TOS));
+    }
+    memo_create();
+}
+
+#endif
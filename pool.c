@@ -0,0 +1,506 @@
+#ifndef __POOL_C__
+#define __POOL_C__
+
+#include <pthread.h>
+
+#include "mem.c"
+#include "vm.c"
+
+// Objects are passed between interpreters as messages: the objects reachable
+// from some roots, laid out as in a heap, with references replaced by their
+// offset in the message. A message is made by a copying pass like the one of
+// the collector (see gc_scan()), except that the originals are not touched,
+// so several threads can copy from the same heap at the same time, as long
+// as its interpreter is not running. Symbols are interned again when a
+// message is read, so they can still be compared by identity.
+//
+// The global environment of the writer is not copied: references to it are
+// replaced by references to the global environment given to the reader.
+
+typedef struct {
+    char *buf;
+    size_t len, size;           // bytes of objects, and allocated size
+    obj **roots;                // offsets or immediate values
+    size_t n_roots;
+    obj *global;                // global environment of the writer
+    obj **keys;                 // originals of the objects in the message,
+    size_t *offsets;            // and their offsets (an open addressing
+    size_t n_keys, keys_size;   // hash table)
+    size_t *symbols;            // offsets of the symbols, while reading
+} message;
+
+// Offset 0 is never used for an object, so that NULL is left alone, and
+// offset MSG_GLOBAL stands for the global environment.
+#define MSG_GLOBAL  ((obj*)gc_align(1))
+#define MSG_START   (2*gc_align(1))
+
+// Free the memory of m. It can be freed again, and written again.
+static void msg_free(message *m) {
+    free(m->buf);
+    free(m->roots);
+    free(m->keys);
+    free(m->offsets);
+    free(m->symbols);
+    memset(m, 0, sizeof(*m));
+}
+
+static inline size_t msg_hash(obj *o) {
+    return ((uintptr_t)o * 0x9e3779b97f4a7c15ull) >> 20;
+}
+
+// Look o up in the table, and return the slot where it is or should go.
+static size_t msg_slot(message *m, obj *o) {
+    const size_t mask = m->keys_size - 1;
+    size_t i;
+    for (i=msg_hash(o) & mask; m->keys[i] && m->keys[i] != o; i=(i+1) & mask);
+    return i;
+}
+
+static void msg_keys_resize(message *m, size_t size) {
+    obj **keys = m->keys;
+    size_t *offsets = m->offsets;
+    size_t i, old_size = m->keys_size;
+    m->keys = calloc(size, sizeof(obj*));
+    m->offsets = malloc(size*sizeof(size_t));
+    m->keys_size = size;
+    for (i=0; i<old_size; i++) {
+        if (keys[i]) {
+            size_t j = msg_slot(m, keys[i]);
+            m->keys[j] = keys[i];
+            m->offsets[j] = offsets[i];
+        }
+    }
+    free(keys);
+    free(offsets);
+}
+
+// Return the offset of the copy of o in the message, copying it unless this
+// has been done already. The references of the copy are updated later.
+static obj *msg_forward(message *m, obj *o) {
+    if (!gc_is_ref(o) || o == NULL) return o;
+    if (o == m->global) return MSG_GLOBAL;
+    if (2*(m->n_keys + 1) > m->keys_size) msg_keys_resize(m, 2*m->keys_size);
+    size_t i = msg_slot(m, o);
+    if (!m->keys[i]) {
+        const size_t size = obj_size(o);
+        while (m->len + size > m->size) {
+            m->size *= 2;
+            m->buf = realloc(m->buf, m->size);
+        }
+        obj *copy = (obj*)(m->buf + m->len);
+        memcpy(copy, o, size);
+        copy->live = 0;
+        copy->remembered = 0;
+        m->keys[i] = o;
+        m->offsets[i] = m->len;
+        m->n_keys++;
+        m->len = gc_align(m->len + size);
+    }
+    return (obj*)m->offsets[i];
+}
+
+// Make a message of everything reachable from roots[0] ... roots[n-1] in
+// the current heap, except the global environment global. Nothing is
+// allocated in the heap.
+static void msg_write(message *m, obj **roots, size_t n, obj *global) {
+    size_t scan, i;
+    m->size = 0x1000;
+    m->buf = malloc(m->size);
+    m->len = MSG_START;
+    m->keys_size = 0x40;
+    m->keys = calloc(m->keys_size, sizeof(obj*));
+    m->offsets = malloc(m->keys_size*sizeof(size_t));
+    m->n_keys = 0;
+    m->n_roots = n;
+    m->roots = malloc(n*sizeof(obj*));
+    m->global = global;
+    m->symbols = NULL;
+    for (i=0; i<n; i++) m->roots[i] = msg_forward(m, roots[i]);
+    for (scan=MSG_START; scan<m->len; ) {
+        obj *o = (obj*)(m->buf + scan);
+        // Cached lookups are only valid in the interpreter they were made
+        // in, and would copy the values found.
+        if (obj_type(o) == TYPE_CODE) code_clear_caches(o);
+        for (i=0; i<obj_n_refs(o); i++) {
+            obj *r = msg_forward(m, o->ref[i]);
+            o = (obj*)(m->buf + scan);      // msg_forward may move buf
+            o->ref[i] = r;
+        }
+        scan = gc_align(scan + obj_size(o));
+    }
+    free(m->keys);
+    free(m->offsets);
+    m->keys = NULL;
+    m->offsets = NULL;
+}
+
+static int msg_is_symbol(obj *o) {
+    return obj_type(o) == TYPE_SYMBOL;
+}
+
+// The object at offset r of a message which has been copied to block, or
+// the interned symbol for it (symbols[i] is the offset of the symbol at
+// stack[base-1-i]), or the global environment at stack[base].
+static obj *msg_resolve(obj *r, const size_t *symbols, size_t n_symbols,
+                        void *block, size_t base) {
+    size_t lo = 0, hi = n_symbols;
+    if (!gc_is_ref(r) || r == NULL) return r;
+    if (r == MSG_GLOBAL) return vm->stack[base];
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (symbols[mid] < (size_t)r) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < n_symbols && symbols[lo] == (size_t)r)
+        return vm->stack[base - 1 - lo];
+    return block + ((size_t)r - MSG_START);
+}
+
+// ( -- root1 ... rootn )
+// Copy the objects of the message into the heap of the current interpreter,
+// with global as the global environment.
+static void msg_read(message *m, obj *global) {
+    push(global);
+    const size_t base = vm->sptr;
+    size_t n_symbols = 0, pos, i;
+
+    // Intern the symbols first, keeping them on the stack, since this may
+    // collect garbage.
+    for (pos=MSG_START; pos<m->len; ) {
+        obj *o = (obj*)(m->buf + pos);
+        if (msg_is_symbol(o)) {
+            const char *name = ((native_symbol*)obj_binary_ptr(o))->x;
+            push(new_symbol_len(name, strlen(name)));
+            m->symbols = realloc(m->symbols, (n_symbols+1)*sizeof(size_t));
+            m->symbols[n_symbols++] = pos;
+        }
+        pos = gc_align(pos + obj_size(o));
+    }
+
+    // Copy everything to the old space, and update the references.
+    heap *h = &vm->heap;
+    void *block = gc_alloc_old(h, m->len - MSG_START);
+    memcpy(block, m->buf + MSG_START, m->len - MSG_START);
+
+#define MSG_OBJ(r) msg_resolve(r, m->symbols, n_symbols, block, base)
+    for (pos=MSG_START; pos<m->len; ) {
+        obj *o = block + (pos - MSG_START);
+        int young = 0;
+        for (i=0; i<obj_n_refs(o); i++) {
+            o->ref[i] = MSG_OBJ(o->ref[i]);
+            young |= gc_is_young(h, o->ref[i]);
+        }
+        if (young) gc_remember(h, o);
+        pos = gc_align(pos + obj_size(o));
+    }
+    obj *roots[m->n_roots];
+    for (i=0; i<m->n_roots; i++) roots[i] = MSG_OBJ(m->roots[i]);
+#undef MSG_OBJ
+
+    vm->sptr = base + 1;
+    stack_popped();
+    for (i=0; i<m->n_roots; i++) push(roots[i]);
+    free(m->symbols);
+    m->symbols = NULL;
+}
+
+// The worker pool runs pmap. Each worker has an interpreter of its own.
+// The list is split into ranges of elements, one per worker; a worker which
+// has finished its range steals half of what is left of the range of
+// another worker, so elements which take long to compute are spread out.
+//
+// The interpreter calling pmap waits until all workers are done, so they
+// can copy the function and the elements straight from its heap. The
+// results are passed back as messages.
+//
+// The global environment of the caller is not copied along with the
+// function, which would copy every global. Instead each worker starts a job
+// with an empty global environment, and pool_import() copies a binding from
+// the global environment of the caller the first time the worker looks it
+// up, so only the globals which are used are copied.
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t begin, end;          // elements which have not been started
+} pool_range;
+
+typedef struct {
+    obj *fun;                   // in the heap of the caller
+    obj **items;                // in the heap of the caller
+    obj *global;                // in the heap of the caller
+    message *results;
+    size_t n;
+    int failed;
+    char message[sizeof(((catch_frame*)0)->message)];
+} pool_job;
+
+static size_t pool_size = 1;        // number of workers to start
+static void (*pool_create_interp)(void);
+static size_t n_workers = 0;        // number of workers started
+static pool_range *pool_ranges;
+
+// Only one interpreter at a time can use the pool.
+static pthread_mutex_t pool_use = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pool_job *pool_current;
+static uint64_t pool_generation;
+static size_t pool_finished;
+
+static __thread int pool_is_worker = 0;
+static __thread pool_job *pool_running;     // job of this worker, or NULL
+static __thread size_t pool_global;         // stack index of its globals
+static __thread message pool_msg;           // being copied to this worker
+
+// Take the next element for worker w, stealing if necessary. Return 0 if
+// there is nothing left to do.
+static int pool_take(size_t w, size_t *item) {
+    pool_range *r = &pool_ranges[w];
+    size_t k;
+    pthread_mutex_lock(&r->lock);
+    if (r->begin < r->end) {
+        *item = r->begin++;
+        pthread_mutex_unlock(&r->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&r->lock);
+    for (k=1; k<n_workers; k++) {
+        pool_range *v = &pool_ranges[(w + k) % n_workers];
+        size_t begin, end;
+        pthread_mutex_lock(&v->lock);
+        end = v->end;
+        begin = v->end - (v->end - v->begin) / 2;
+        if (begin == end && v->begin < v->end) begin--;
+        v->end = begin;
+        pthread_mutex_unlock(&v->lock);
+        if (begin < end) {
+            pthread_mutex_lock(&r->lock);
+            *item = begin;
+            r->begin = begin + 1;
+            r->end = end;
+            pthread_mutex_unlock(&r->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The value bound to the symbol with the given name and hash in env, which
+// is in the heap of another interpreter, or NULL. Symbols are compared by
+// name since they are interned separately by each interpreter. Nothing is
+// modified, so several workers can look up the same environment.
+static obj *pool_lookup(obj *env, const char *name, uint32_t hash) {
+    for (; env != NIL; env=ENV_PARENT(env)) {
+        obj *slots = ENV_SLOTS(env);
+        const size_t mask = slots->len/2 - 1;
+        size_t i;
+        for (i=hash & mask; slots->ref[2*i] != NIL; i=(i+1) & mask) {
+            obj *k = slots->ref[2*i];
+            if (obj_type(k) == TYPE_SYMBOL &&
+                !strcmp(((native_symbol*)obj_binary_ptr(k))->x, name))
+            {
+                return slots->ref[2*i+1];
+            }
+        }
+    }
+    return NULL;
+}
+
+// ( -- root1 ... rootn )
+// Copy the objects reachable from roots in the heap of the caller of pmap to
+// this worker. The message is kept in pool_msg while it is read, so that it
+// is freed also when reading raises an error: by pool_run(), or by the next
+// pool_copy() if the error is caught by the job itself.
+static void pool_copy(obj **roots, size_t n) {
+    msg_free(&pool_msg);
+    msg_write(&pool_msg, roots, n, pool_running->global);
+    msg_read(&pool_msg, vm->stack[pool_global]);
+    msg_free(&pool_msg);
+}
+
+// ( -- value ) if it returns 1
+// If this is a worker running a job, copy the value bound to sym in the
+// global environment of the caller of pmap to the global environment of
+// the job, and return 1. Return 0 if there is no such binding.
+static int pool_import(obj *sym) {
+    if (!pool_running) return 0;
+    const native_symbol *s = obj_binary_ptr(sym);
+    obj *value = pool_lookup(pool_running->global, s->x, s->hash);
+    if (!value) return 0;
+    push(sym);
+    pool_copy(&value, 1);                   // sym value
+    push(vm->stack[pool_global]);
+    core_rot();
+    push(PICK(2));                          // value global sym value
+    core_define();
+    core_drop();
+    return 1;
+}
+
+static void pool_run(pool_job *job, size_t w) {
+    catch_frame c;
+    size_t i;
+    c.prev = NULL;
+    c.sptr = vm->sptr;
+    c.rptr = vm->rptr;
+    c.prof_depth = 0;
+    if (setjmp(c.env)) {
+        vm->catcher = NULL;
+        pool_running = NULL;
+        msg_free(&pool_msg);
+        vm->sptr = c.sptr;
+        stack_popped();
+        vm->rptr = c.rptr;
+        pthread_mutex_lock(&pool_lock);
+        if (!job->failed) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            memcpy(job->message, c.message, sizeof(job->message));
+        }
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+    vm->catcher = &c;
+
+    push(NIL);
+    core_env(0x20);                         // global
+    pool_global = vm->sptr;
+    pool_running = job;
+    pool_copy(&job->fun, 1);                // global fun
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED) &&
+           pool_take(w, &i))
+    {
+        pool_copy(&job->items[i], 1);
+        core_over();                        // global fun item fun
+        core_apply(1);                      // global fun result
+        msg_write(&job->results[i], &TOS, 1, vm->stack[pool_global]);
+        core_drop();
+    }
+    core_drop();
+    core_drop();
+    pool_running = NULL;
+    vm->catcher = NULL;
+}
+
+static void *pool_worker(void *arg) {
+    const size_t w = (size_t)arg;
+    uint64_t generation = 0;
+    pool_is_worker = 1;
+    pool_create_interp();
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_generation == generation)
+            pthread_cond_wait(&pool_start, &pool_lock);
+        generation = pool_generation;
+        pool_job *job = pool_current;
+        pthread_mutex_unlock(&pool_lock);
+
+        pool_run(job, w);
+        eq_stack_free();
+
+        pthread_mutex_lock(&pool_lock);
+        if (++pool_finished == n_workers) pthread_cond_signal(&pool_done);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+// Use n workers, which call create_interp() to make their interpreter. The
+// threads are started when pmap is first called.
+static void pool_init(size_t n, void (*create_interp)(void)) {
+    pool_size = n;
+    pool_create_interp = create_interp;
+}
+
+static void pool_create(void) {
+    size_t i;
+    pool_ranges = malloc(pool_size*sizeof(pool_range));
+    for (i=0; i<pool_size; i++) {
+        pthread_t thread;
+        pthread_mutex_init(&pool_ranges[i].lock, NULL);
+        int err = pthread_create(&thread, NULL, pool_worker, (void*)i);
+        if (err) {
+            error(1, err, "Can not create thread");
+        }
+        pthread_detach(thread);
+    }
+    n_workers = pool_size;
+}
+
+// ( f list -- list2 )
+// Apply f to every element of list in the worker pool, or in the current
+// thread if this is a worker itself.
+static void core_pmap(void) {
+    pool_job job;
+    size_t n = 0, i;
+    obj *l;
+    for (l=TOS; l!=NIL; l=TAIL(l)) {
+        obj_assert_type(l, TYPE_CONS);
+        n++;
+    }
+
+    if (pool_is_worker || pool_size == 1) {
+        push(NIL);                          // f list acc
+        while (NOS != NIL) {
+            push(HEAD(NOS));
+            push(PICK(3));
+            core_apply(1);                  // f list acc result
+            core_swap();
+            core_cons();
+            NOS = TAIL(NOS);
+        }
+        core_nip();                         // f reversed
+        push(NIL);
+        while (NOS != NIL) {
+            push(HEAD(NOS));
+            core_swap();
+            core_cons();
+            NOS = TAIL(NOS);
+        }
+        core_nip();
+        core_nip();
+        return;
+    }
+
+    pthread_mutex_lock(&pool_use);
+    if (!n_workers) pool_create();
+    job.fun = NOS;
+    job.global = GLOBAL;
+    job.items = malloc(n*sizeof(obj*));
+    for (i=0, l=TOS; i<n; i++, l=TAIL(l)) job.items[i] = HEAD(l);
+    job.results = calloc(n, sizeof(message));
+    job.n = n;
+    job.failed = 0;
+    for (i=0; i<n_workers; i++) {
+        pool_ranges[i].begin = n*i / n_workers;
+        pool_ranges[i].end = n*(i+1) / n_workers;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool_current = &job;
+    pool_finished = 0;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_start);
+    while (pool_finished < n_workers)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&pool_use);
+    free(job.items);
+
+    if (job.failed) {
+        for (i=0; i<n; i++) msg_free(&job.results[i]);
+        free(job.results);
+        lisp_error("%s", job.message);
+    }
+    core_drop();
+    TOS = NIL;                              // nil
+    for (i=n; i--; ) {
+        msg_read(&job.results[i], GLOBAL);  // list result
+        msg_free(&job.results[i]);
+        core_swap();
+        core_cons();
+    }
+    free(job.results);
+}
+
+#endif
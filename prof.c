@@ -0,0 +1,280 @@
+#ifndef __PROF_C__
+#define __PROF_C__
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "mem.c"
+
+// The profiler records a calling context tree: there is a node for every
+// distinct chain of calls starting at the top level, which counts the calls
+// and the time spent and bytes allocated, both including and excluding the
+// callees. Lambdas are identified by the symbol their code was first bound
+// to with define, natfuns by their registered name.
+//
+// Every call and return is timed. In addition, the running function is
+// sampled every millisecond of CPU time (with SIGPROF), which is not skewed
+// by the cost of timing the calls.
+//
+// The virtual machine only calls the profiler if profiling is non-zero, so
+// there is no other cost when it is disabled. Only the thread which called
+// prof_start() is profiled.
+
+typedef struct {
+    uint32_t fn;                // index into prof_fns
+    uint32_t parent;            // parent node
+    uint32_t child;             // first child node, or 0
+    uint32_t next;              // next sibling node, or 0
+    uint64_t calls;
+    uint64_t time;              // time including callees (ns)
+    uint64_t self_time;         // time excluding callees (ns)
+    uint64_t alloc;             // bytes allocated including callees
+    uint64_t self_alloc;        // bytes allocated excluding callees
+    uint64_t samples;
+} prof_node;
+
+// A function which has been entered but not left.
+typedef struct {
+    uint32_t node;
+    uint64_t start;             // gc_time() when the function was entered
+    uint64_t alloc_start;       // bytes allocated when it was entered
+    uint64_t child_time;        // time spent in callees so far
+    uint64_t child_alloc;       // bytes allocated by callees so far
+} prof_frame;
+
+static __thread int profiling = 0;
+
+static char **prof_fns;         // function names
+static size_t n_prof_fns, prof_fns_size;
+static uint32_t prof_natfun_ids[NATFUNS_SIZE + 1];
+
+static prof_node *prof_nodes;   // node 0 is the root (the reader etc.)
+static size_t n_prof_nodes, prof_nodes_size;
+
+static prof_frame *prof_stack;
+static size_t prof_depth, prof_stack_size;
+
+static volatile sig_atomic_t prof_pending = 0;
+
+static void prof_signal(int sig) {
+    (void)sig;
+    prof_pending++;
+}
+
+// The id of the function with the given name (ids start at 1).
+static uint32_t prof_fn_id(const char *name) {
+    size_t i;
+    for (i=0; i<n_prof_fns; i++) {
+        if (!strcmp(prof_fns[i], name)) return i + 1;
+    }
+    if (n_prof_fns == prof_fns_size) {
+        prof_fns_size *= 2;
+        prof_fns = realloc(prof_fns, prof_fns_size*sizeof(char*));
+    }
+    prof_fns[n_prof_fns++] = strdup(name);
+    return n_prof_fns;
+}
+
+static void prof_start(void) {
+    prof_fns_size = 0x40;
+    prof_fns = malloc(prof_fns_size*sizeof(char*));
+    n_prof_fns = 0;
+    prof_nodes_size = 0x100;
+    prof_nodes = malloc(prof_nodes_size*sizeof(prof_node));
+    memset(&prof_nodes[0], 0, sizeof(prof_node));
+    n_prof_nodes = 1;
+    prof_stack_size = 0x100;
+    prof_stack = malloc(prof_stack_size*sizeof(prof_frame));
+    prof_depth = 0;
+    profiling = 1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sa, NULL);
+    struct itimerval timer = {{0, 1000}, {0, 1000}};
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Attribute the samples taken since the last call to the running function.
+static inline void prof_take_samples(void) {
+    if (prof_pending) {
+        const uint32_t n = prof_depth? prof_stack[prof_depth-1].node : 0;
+        prof_nodes[n].samples += __sync_lock_test_and_set(&prof_pending, 0);
+    }
+}
+
+static void prof_enter(uint32_t fn) {
+    const uint32_t parent = prof_depth? prof_stack[prof_depth-1].node : 0;
+    uint32_t n;
+    prof_take_samples();
+    for (n=prof_nodes[parent].child; n; n=prof_nodes[n].next) {
+        if (prof_nodes[n].fn == fn) break;
+    }
+    if (!n) {
+        if (n_prof_nodes == prof_nodes_size) {
+            prof_nodes_size *= 2;
+            prof_nodes = realloc(prof_nodes,
+                                 prof_nodes_size*sizeof(prof_node));
+        }
+        n = n_prof_nodes++;
+        memset(&prof_nodes[n], 0, sizeof(prof_node));
+        prof_nodes[n].fn = fn;
+        prof_nodes[n].parent = parent;
+        prof_nodes[n].next = prof_nodes[parent].child;
+        prof_nodes[parent].child = n;
+    }
+    prof_nodes[n].calls++;
+
+    if (prof_depth == prof_stack_size) {
+        prof_stack_size *= 2;
+        prof_stack = realloc(prof_stack, prof_stack_size*sizeof(prof_frame));
+    }
+    prof_frame *f = &prof_stack[prof_depth++];
+    f->node = n;
+    f->child_time = 0;
+    f->child_alloc = 0;
+    f->alloc_start = vm->heap.bytes_allocated;
+    f->start = gc_time();
+}
+
+static void prof_leave(void) {
+    const uint64_t now = gc_time();
+    prof_take_samples();
+    prof_frame *f = &prof_stack[--prof_depth];
+    prof_node *n = &prof_nodes[f->node];
+    const uint64_t t = now - f->start;
+    const uint64_t a = vm->heap.bytes_allocated - f->alloc_start;
+    n->time += t;
+    n->self_time += t - f->child_time;
+    n->alloc += a;
+    n->self_alloc += a - f->child_alloc;
+    if (prof_depth) {
+        prof_stack[prof_depth-1].child_time += t;
+        prof_stack[prof_depth-1].child_alloc += a;
+    }
+}
+
+// Enter the code of a lambda, or top-level code.
+static void prof_enter_code(obj *code) {
+    if (!CODE_PROF_ID(code)) {
+        const char *name = "<lambda>";
+        if (CODE_DEPTH(code) == 0)
+            name = "<toplevel>";
+        else if (CODE_NAME(code) != NIL)
+            name = ((native_symbol*)obj_binary_ptr(CODE_NAME(code)))->x;
+        CODE_PROF_ID(code) = prof_fn_id(name);
+    }
+    prof_enter(CODE_PROF_ID(code));
+}
+
+static void prof_enter_natfun(obj *o) {
+    const size_t i = natfun_index(((native_natfun*)obj_binary_ptr(o))->x);
+    if (!prof_natfun_ids[i])
+        prof_natfun_ids[i] = prof_fn_id((i < n_natfuns)? natfuns[i].name
+                                                         : "<natfun>");
+    prof_enter(prof_natfun_ids[i]);
+}
+
+// Leave all functions which are still running, e.g. after an error.
+static void prof_stop(void) {
+    struct itimerval timer = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    while (prof_depth) prof_leave();
+    prof_take_samples();
+    profiling = 0;
+}
+
+typedef struct {
+    uint32_t fn;
+    uint64_t calls, time, self_time, alloc, self_alloc, samples;
+} prof_total;
+
+static int prof_compare(const void *a, const void *b) {
+    const prof_total *x = a, *y = b;
+    if (x->self_time != y->self_time)
+        return (x->self_time < y->self_time)? 1 : -1;
+    return (x->time < y->time) - (x->time > y->time);
+}
+
+// Print the totals per function, sorted by time excluding callees. The time
+// and allocations including callees only count the outermost call of a
+// recursive function.
+static void prof_write_report(FILE *f) {
+    prof_total *totals = calloc(n_prof_fns, sizeof(prof_total));
+    uint32_t *active = calloc(n_prof_fns, sizeof(uint32_t));
+    uint64_t time = 0, samples = prof_nodes[0].samples;
+    size_t i;
+    uint32_t n;
+    for (i=0; i<n_prof_fns; i++) totals[i].fn = i + 1;
+
+    // Walk the tree depth first, counting how often each function occurs
+    // on the path from the root.
+    for (n=prof_nodes[0].child; n; ) {
+        const prof_node *node = &prof_nodes[n];
+        prof_total *t = &totals[node->fn - 1];
+        t->calls += node->calls;
+        t->self_time += node->self_time;
+        t->self_alloc += node->self_alloc;
+        t->samples += node->samples;
+        samples += node->samples;
+        if (!active[node->fn - 1]) {
+            t->time += node->time;
+            t->alloc += node->alloc;
+        }
+        if (node->parent == 0) time += node->time;
+        active[node->fn - 1]++;
+        if (node->child) {
+            n = node->child;
+            continue;
+        }
+        for (; n; n=prof_nodes[n].parent) {
+            active[prof_nodes[n].fn - 1]--;
+            if (prof_nodes[n].next) {
+                n = prof_nodes[n].next;
+                break;
+            }
+        }
+    }
+    free(active);
+    qsort(totals, n_prof_fns, sizeof(prof_total), prof_compare);
+
+    fprintf(f, "Total: %.3f ms in functions, %" PRIu64 " samples\n\n",
+            time / 1e6, samples);
+    fprintf(f, "%10s %12s %12s %12s %12s %8s  %s\n", "calls", "total ms",
+            "self ms", "total KB", "self KB", "samples", "function");
+    for (i=0; i<n_prof_fns; i++) {
+        const prof_total *t = &totals[i];
+        fprintf(f, "%10" PRIu64 " %12.3f %12.3f %12.1f %12.1f %8" PRIu64
+                "  %s\n", t->calls, t->time / 1e6, t->self_time / 1e6,
+                t->alloc / 1024.0, t->self_alloc / 1024.0, t->samples,
+                prof_fns[t->fn - 1]);
+    }
+    free(totals);
+}
+
+// Print one line per calling context, with the names of the functions from
+// the top level down separated by semicolons, followed by the time excluding
+// callees in microseconds. This is the "collapsed stack" format read by
+// flame graph tools.
+static void prof_write_collapsed(FILE *f) {
+    uint32_t *path = malloc(n_prof_nodes*sizeof(uint32_t));
+    size_t n, len;
+    for (n=1; n<n_prof_nodes; n++) {
+        const uint64_t us = prof_nodes[n].self_time / 1000;
+        uint32_t p;
+        if (!us) continue;
+        for (len=0, p=n; p; p=prof_nodes[p].parent) path[len++] = p;
+        while (len--) {
+            fputs(prof_fns[prof_nodes[path[len]].fn - 1], f);
+            fputc(len? ';' : ' ', f);
+        }
+        fprintf(f, "%" PRIu64 "\n", us);
+    }
+    free(path);
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef __TABLE_C__
+#define __TABLE_C__
+
+#include "core.c"
+
+// Hash tables map keys to values, where keys are compared with obj_equal()
+// like core_eq does, and hashed with obj_hash_deep() (see native_table in
+// mem.c). Hashes do not depend on addresses, so the collector can move keys
+// around freely.
+//
+// A table grows when it has more entries than buckets. Rather than moving
+// all entries at once, it keeps the old buckets and every operation on the
+// table moves the entries of TABLE_STEP of them, so the cost of growing is
+// spread over the operations which made it necessary. Until all of them are
+// moved, keys are looked up in both the new and the old buckets. Tables do
+// not shrink.
+
+#define TABLE_ENTRY_SIZE    4
+#define TABLE_MIN_BUCKETS   8
+#define TABLE_STEP          4
+
+// ( -- buckets )
+static void table_buckets(size_t n) {
+    obj *o = new_obj(TYPE_VECTOR, n, 0);
+    size_t i;
+    for (i=0; i<n; i++) o->ref[i] = NIL;
+    push(o);
+}
+
+// Move the entries of up to n old buckets of table t to the new ones.
+static void table_move(obj *t, size_t n) {
+    obj *old = TABLE_OLD(t), *buckets = TABLE_BUCKETS(t);
+    const size_t mask = VECTOR_LEN(buckets) - 1;
+    for (; n && TABLE_MOVED(t) < VECTOR_LEN(old); n--) {
+        const size_t i = TABLE_MOVED(t)++;
+        obj *e = old->ref[i];
+        while (e != NIL) {
+            obj *next = ENTRY_NEXT(e);
+            const size_t j = fixnum_value(ENTRY_HASH(e)) & mask;
+            ENTRY_NEXT(e) = buckets->ref[j];
+            gc_write(&vm->heap, e);
+            buckets->ref[j] = e;
+            e = next;
+        }
+        old->ref[i] = NIL;
+    }
+    gc_write(&vm->heap, buckets);
+    if (TABLE_MOVED(t) == VECTOR_LEN(old)) {
+        TABLE_OLD(t) = NIL;
+        TABLE_MOVED(t) = 0;
+    }
+}
+
+// Do a step of resizing t, if it is being resized.
+static void table_step(obj *t) {
+    obj_assert_type(t, TYPE_HASHTABLE);
+    if (TABLE_OLD(t) != NIL) table_move(t, TABLE_STEP);
+}
+
+// The entry for key in buckets, or nil.
+static obj *table_find(obj *buckets, obj *key, uint32_t hash) {
+    obj *e = buckets->ref[hash & (VECTOR_LEN(buckets) - 1)];
+    for (; e != NIL; e=ENTRY_NEXT(e)) {
+        if (ENTRY_HASH(e) == make_fixnum(hash) &&
+            (ENTRY_KEY(e) == key || obj_equal(ENTRY_KEY(e), key)))
+            return e;
+    }
+    return NIL;
+}
+
+// The entry for key in table t, or nil.
+static obj *table_entry(obj *t, obj *key, uint32_t hash) {
+    obj *e = table_find(TABLE_BUCKETS(t), key, hash);
+    if (e == NIL && TABLE_OLD(t) != NIL)
+        e = table_find(TABLE_OLD(t), key, hash);
+    return e;
+}
+
+// Unlink the entry for key from its chain in buckets, and return whether it
+// was found.
+static int table_unlink(obj *buckets, obj *key, uint32_t hash) {
+    const size_t i = hash & (VECTOR_LEN(buckets) - 1);
+    obj *e = buckets->ref[i], *prev = NIL;
+    for (; e != NIL; prev=e, e=ENTRY_NEXT(e)) {
+        if (ENTRY_HASH(e) == make_fixnum(hash) &&
+            (ENTRY_KEY(e) == key || obj_equal(ENTRY_KEY(e), key)))
+        {
+            if (prev == NIL) {
+                buckets->ref[i] = ENTRY_NEXT(e);
+                gc_write_ref(&vm->heap, buckets, i);
+            } else {
+                ENTRY_NEXT(prev) = ENTRY_NEXT(e);
+                gc_write(&vm->heap, prev);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ( table key value -- table key value )
+// Start resizing the table if it has as many entries as buckets, after
+// finishing any resize still going on.
+static void table_grow(void) {
+    obj *t = PICK(2);
+    if (TABLE_COUNT(t) < VECTOR_LEN(TABLE_BUCKETS(t))) return;
+    if (TABLE_OLD(t) != NIL) table_move(t, VECTOR_LEN(TABLE_OLD(t)));
+    table_buckets(2*VECTOR_LEN(TABLE_BUCKETS(t)));
+    t = PICK(3);
+    TABLE_OLD(t) = TABLE_BUCKETS(t);
+    TABLE_BUCKETS(t) = pop();
+    TABLE_MOVED(t) = 0;
+    gc_write(&vm->heap, t);
+    table_move(t, TABLE_STEP);
+}
+
+// ( -- table )
+static void core_make_table(void) {
+    native_table data;
+    data.count = 0;
+    data.moved = 0;
+    table_buckets(TABLE_MIN_BUCKETS);
+    obj *o = new_obj_fill(TYPE_HASHTABLE, 2, &data, sizeof(data));
+    TABLE_BUCKETS(o) = TOS;
+    TABLE_OLD(o) = NIL;
+    TOS = o;
+}
+
+// ( table key -- value )
+// The value bound to key, or nil.
+static void core_table_get(void) {
+    table_step(NOS);
+    obj *e = table_entry(NOS, TOS, obj_hash_deep(TOS));
+    core_drop();
+    TOS = (e != NIL)? ENTRY_VALUE(e) : NIL;
+}
+
+// ( table key value -- table )
+// Bind key to value, replacing any previous binding of key.
+static void core_table_put(void) {
+    table_step(PICK(2));
+    const uint32_t hash = obj_hash_deep(NOS);
+    obj *e = table_entry(PICK(2), NOS, hash);
+    if (e == NIL) {
+        table_grow();
+        e = new_small(TYPE_VECTOR, TABLE_ENTRY_SIZE, 0);
+        obj *buckets = TABLE_BUCKETS(PICK(2));
+        const size_t i = hash & (VECTOR_LEN(buckets) - 1);
+        ENTRY_KEY(e) = NOS;
+        ENTRY_HASH(e) = make_fixnum(hash);
+        ENTRY_NEXT(e) = buckets->ref[i];
+        buckets->ref[i] = e;
+        gc_write_ref(&vm->heap, buckets, i);
+        TABLE_COUNT(PICK(2))++;
+    }
+    ENTRY_VALUE(e) = TOS;
+    gc_write(&vm->heap, e);
+    core_drop();
+    core_drop();
+}
+
+// ( table key -- table )
+// Remove the binding of key, if any.
+static void core_table_remove(void) {
+    table_step(NOS);
+    const uint32_t hash = obj_hash_deep(TOS);
+    obj *t = NOS;
+    if (table_unlink(TABLE_BUCKETS(t), TOS, hash) ||
+        (TABLE_OLD(t) != NIL && table_unlink(TABLE_OLD(t), TOS, hash)))
+    {
+        TABLE_COUNT(t)--;
+    }
+    core_drop();
+}
+
+// ( table -- n )
+static void core_table_count(void) {
+    obj_assert_type(TOS, TYPE_HASHTABLE);
+    TOS = new_integer(TABLE_COUNT(TOS));
+}
+
+// ( table list -- table list2 )
+// Add the bindings in the buckets table->ref[k] to the list.
+static void table_list(size_t k) {
+    size_t i = (NOS->ref[k] != NIL)? VECTOR_LEN(NOS->ref[k]) : 0;
+    while (i > 0) {
+        push(NOS->ref[k]->ref[--i]);    // table list e
+        while (TOS != NIL) {
+            push(ENTRY_KEY(TOS));
+            push(ENTRY_VALUE(NOS));
+            core_cons();
+            push(PICK(2));
+            core_cons();                // table list e key::value::list
+            PICK(2) = TOS;
+            core_drop();
+            TOS = ENTRY_NEXT(TOS);
+        }
+        core_drop();
+    }
+}
+
+// ( table -- list )
+// A list of the bindings of the table as key::value pairs, in no particular
+// order.
+static void core_table_list(void) {
+    obj_assert_type(TOS, TYPE_HASHTABLE);
+    push(NIL);
+    table_list(0);
+    table_list(1);
+    core_nip();
+}
+
+#endif
@@ -33,3 +33,185 @@
 (print "Please have some factorials.")
 (print (map ! (range 1 13)))
 
+
+(define length
+  (lambda (xs)
+    (if (= xs ())
+      0
+      (+ 1 (length (tail xs))))))
+
+(define empties
+  (lambda (n xs)
+    (if (= n 0)
+      xs
+      (empties (- n 1) (cons (make-vector 0 0) (cons (list->array ()) xs))))))
+
+(print "Empty vectors and arrays survive a collection.")
+(define kept (empties 1000 ()))
+(define garbage (range 1 20000))
+(print (length kept))
+(print (vector-length (head kept)))
+(print (array-length (head (tail kept))))
+
+(define down
+  (memoize
+    (lambda (n)
+      (if (= n 0)
+        0
+        (+ 1 (down (- n 1)))))))
+
+(define pair (memoize (lambda () (cons 1 2))))
+
+(print "Memoized functions can recurse deeply, and take no arguments.")
+(print (pair))
+(print (down 200000))
+(print (pair))
+
+(define then (lambda (x y) y))
+(define calls (make-vector 1 0))
+(define count-call
+  (lambda (x) (then (vector-set! calls 0 (+ 1 (vector-ref calls 0))) x)))
+
+(define inc (lambda (x) (+ x 1)))
+(define call-inc (memoize (lambda (f) (count-call (f 1)))))
+
+(print "Memoized functions find lambda arguments again after they ran.")
+(print (call-inc inc))
+(print (call-inc inc))
+(print (vector-ref calls 0))
+
+(define dbl (lambda (x) (* x 2)))
+(define fun-table (table-put! (make-table) (cons dbl 1) "dbl"))
+
+(print "Tables find keys containing lambdas again after they ran.")
+(print (dbl 21))
+(print (table-get fun-table (cons dbl 1)))
+
+(define malformed
+  (lambda (expr) (catch (lambda () (eval (global) expr)) (lambda (e) e))))
+
+(print "Malformed expressions raise errors, which can be caught.")
+(print (malformed (quote (lambda 5 x))))
+(print (malformed (quote (lambda (x 5) x))))
+(print (malformed (quote (lambda x))))
+(print (malformed (quote (if))))
+(print (malformed (quote (quote))))
+(print (malformed (quote (define 5 x))))
+
+(define caught (lambda (thunk) (catch thunk (lambda (e) e))))
+(define deep (lambda (n) (+ 1 (deep (+ n 1)))))
+
+(print "Errors can be caught, and the program goes on.")
+(print (caught (lambda () (deep 0))))
+(print (caught (lambda () unbound-symbol)))
+(print (caught (lambda () (+ 1 "one"))))
+(print (caught (lambda () (head 5))))
+(print (caught (lambda () 42)))
+
+(define offset 100)
+(define add-offset (lambda (x) (+ x offset)))
+
+(print "Parallel maps agree with map, and pass errors on to the caller.")
+(print (= (pmap add-offset (range 1 50)) (map add-offset (range 1 50))))
+(print (pmap (lambda (x) (* x x)) (range 1 10)))
+(print (caught (lambda () (pmap (lambda (x) (if (= x 7) (head x) x))
+                                (range 1 20)))))
+(print (pmap add-offset (range 1 5)))
+
+(define fill
+  (lambda (t n)
+    (if (= n 0)
+      t
+      (fill (table-put! t n (* n n)) (- n 1)))))
+(define empty-odd
+  (lambda (t n)
+    (if (< n 1)
+      t
+      (empty-odd (table-remove! t n) (- n 2)))))
+
+(print "Tables bind keys to values, also while they grow.")
+(define squares (fill (make-table) 1500))
+(print (table-count (make-table)))
+(print (table-get (make-table) 1))
+(print (table-count squares))
+(print (table-get squares 1234))
+(print (table-get squares 1501))
+(print (table-get (table-put! squares 1234 "replaced") 1234))
+(print (table-count squares))
+(print (table-count (empty-odd squares 1499)))
+(print (table-get squares 1233))
+(print (table-get squares 1232))
+(define pairs (table-put! (make-table) (range 1 3) "list"))
+(print (table-get pairs (cons 1 (cons 2 (cons 3 ())))))
+(print (table-get pairs (range 1 4)))
+(print (table->list (table-put! (make-table) "key" "value")))
+(print (length (table->list squares)))
+
+(define v (make-vector 3 0))
+
+(print "Vectors can be made, read and written, and check their indices.")
+(print v)
+(print (vector-set! v 1 "one"))
+(print (vector-ref v 1))
+(print (vector-length v))
+(print (vector->list v))
+(print (list->vector (range 1 4)))
+(print (vector-length (list->vector ())))
+(print (caught (lambda () (vector-ref v 3))))
+(print (caught (lambda () (vector-ref v -1))))
+(print (caught (lambda () (vector-set! v 5 1))))
+(print (caught (lambda () (make-vector -1 0))))
+
+(define ints (list->array (cons 1 (cons -2 (cons 3 ())))))
+(define reals (list->array (cons 1.5 (cons -2.0 (cons 4.0 ())))))
+
+(print "Builtins can be mapped over arrays, binary ones with a number.")
+(print (array-map neg ints))
+(print (array-map neg reals))
+(print (array-map (cons + 10) ints))
+(print (array-map (cons * 3) ints))
+(print (array-map (cons / 2) ints))
+(print (array-map (cons 12 /) ints))
+(print (array-map (cons < 2) ints))
+(print (array-map (cons 2 <) ints))
+(print (array-map (cons + 0.5) reals))
+(print (array-map (cons 1.0 /) reals))
+(print (caught (lambda () (array-map (cons / 0) ints))))
+(print (caught (lambda () (array-map (cons + 0.5) ints))))
+(print (caught (lambda () (array-map head ints))))
+
+(define twos (make-array 3 2))
+
+(print "Arrays add, multiply, divide and compare element-wise, and sum.")
+(print (array+ ints twos))
+(print (array* ints 2))
+(print (array/ 6 twos))
+(print (array< ints twos))
+(print (array+ reals 1.0))
+(print (array-sum ints))
+(print (array-sum reals))
+(print (array-dot ints twos))
+(print (array-dot reals reals))
+(print (array-ref (array-set! twos 1 5) 1))
+(print (array->list twos))
+(print (caught (lambda () (array/ ints (make-array 3 0)))))
+(print (caught (lambda () (array+ ints (make-array 2 1)))))
+(print (caught (lambda () (array-ref ints 3))))
+
+(define stat
+  (lambda (name stats)
+    (if (= (head (head stats)) name)
+      (tail (head stats))
+      (stat name (tail stats)))))
+
+(define stats-before (gc-stats))
+(define allocated (length (range 1 50000)))
+(define stats-after (gc-stats))
+
+(print "Allocating counts bytes, and collects garbage.")
+(print (< (stat (quote bytes-allocated) stats-before)
+          (stat (quote bytes-allocated) stats-after)))
+(print (< (stat (quote allocations) stats-before)
+          (stat (quote allocations) stats-after)))
+(print (< (stat (quote minor-collections) stats-before)
+          (stat (quote minor-collections) stats-after)))
@@ -0,0 +1,723 @@
+#ifndef __VM_C__
+#define __VM_C__
+
+#include "core.c"
+#include "prof.c"
+#include "memo.c"
+
+static int pool_import(obj *sym);   // see pool.c
+
+// Every instruction is three bytes: an opcode followed by a 16-bit little
+// endian argument (which is ignored by some instructions).
+//
+// Variables are resolved at compile time. Arguments of enclosing lambdas are
+// accessed with OP_LOCAL, whose argument is the number of frames to go up
+// (d, in the high byte) and the index of the argument (i, in the low byte).
+// Any other variable is looked up with OP_GLOBAL in the environment which
+// the outermost frame refers to, i.e. the environment given to core_run().
+//
+// The code of a lambda which contains no lambda is flat: nothing can refer
+// to its frame after it returns, so it is called without one. Its arguments
+// stay on the value stack, where OP_ARG reads them, and the stack frame
+// refers to the environment of the lambda instead, so that OP_LOCAL goes up
+// one frame less.
+enum {
+    OP_CONST = 0,   // k        ( -- const[k] )
+    OP_LOCAL,       // d:i      ( -- x ) where x is argument i of frame d
+    OP_ARG,         // k        ( -- x ) where x is stack[fp+k]
+    OP_GLOBAL,      // k        ( -- x ) where x is bound to const[k]
+    OP_CLOSURE,     // k        ( -- lambda(const[k], env) )
+    OP_DEFINE,      // k        ( x -- nil ) binds global const[k] to x
+    OP_JUMP,        // pc
+    OP_JUMPF,       // pc       ( true/false -- ) jumps if false
+    OP_CALL,        // n        ( arg1 ... argn fun -- result )
+    OP_TAILCALL,    // n        ( arg1 ... argn fun -- ) returns the result
+    OP_RETURN,      //          ( result -- )
+    OP_ADD,         // t        ( x y fun -- result ) calls fun, see below
+    OP_EQ,          // t        ( x y fun -- result )
+    OP_LT           // t        ( x y fun -- result )
+};
+
+// Calls of +, = and < with two arguments compile to OP_ADD, OP_EQ and OP_LT,
+// which are OP_TAILCALL 2 if t is 1 and OP_CALL 2 otherwise. While fun is
+// still the builtin natfun, they compute the result themselves if that does
+// not allocate, e.g. the sum of two fixnums.
+
+#define OP_SIZE     3
+#define OP_ARG_MAX  0xffff
+
+typedef struct compiler {
+    struct compiler *parent;    // compiler of the enclosing lambda, or NULL
+    uint8_t *x;             // bytecode
+    size_t len;             // number of bytes used in x
+    size_t size;            // number of bytes allocated for x
+    size_t consts;          // stack index of the (reversed) constant list
+    size_t n_consts;        // length of the constant list
+    size_t scope;           // stack index of the list of vars of the
+                            // enclosing lambdas, innermost first
+    size_t depth;           // length of the scope list
+    size_t n_vars;          // number of arguments of the lambda
+    int flat;               // whether the code is flat
+} compiler;
+
+// Free the bytecode of c and the compilers enclosing it, and raise an error.
+__attribute__((noreturn))
+static void compile_error(compiler *c, const char *message) {
+    for (; c; c=c->parent) free(c->x);
+    lisp_error("%s", message);
+}
+
+// Emit an instruction, and return its position.
+static size_t emit(compiler *c, int op, size_t arg) {
+    if (arg > OP_ARG_MAX) {
+        compile_error(c, "Expression too large to compile");
+    }
+    if (c->len + OP_SIZE > c->size) {
+        c->size *= 2;
+        c->x = realloc(c->x, c->size);
+    }
+    c->x[c->len] = op;
+    c->x[c->len+1] = arg & 0xff;
+    c->x[c->len+2] = arg >> 8;
+    c->len += OP_SIZE;
+    return c->len - OP_SIZE;
+}
+
+// Make the jump instruction at position at go to the end of the bytecode.
+static void patch(compiler *c, size_t at) {
+    if (c->len > OP_ARG_MAX) {
+        compile_error(c, "Expression too large to compile");
+    }
+    c->x[at+1] = c->len & 0xff;
+    c->x[at+2] = c->len >> 8;
+}
+
+// ( x -- )
+// Emit op with the index of x in the constant table as argument.
+static void emit_const(compiler *c, int op) {
+    size_t i = c->n_consts;
+    obj *l;
+    for (l=vm->stack[c->consts]; l!=NIL; l=TAIL(l)) {
+        i--;
+        if (HEAD(l) == TOS) {
+            core_drop();
+            emit(c, op, i);
+            return;
+        }
+    }
+    push(vm->stack[c->consts]);
+    core_cons();
+    vm->stack[c->consts] = pop();
+    stack_changed(c->consts + 1);
+    emit(c, op, c->n_consts++);
+}
+
+static void emit_return(compiler *c, int tail) {
+    if (tail) emit(c, OP_RETURN, 0);
+}
+
+// ( symbol -- )
+static void emit_variable(compiler *c) {
+    size_t depth = 0;
+    obj *scope, *var;
+    for (scope=vm->stack[c->scope]; scope!=NIL; scope=TAIL(scope), depth++) {
+        size_t i = 0, index = 0;
+        int found = 0;
+        for (var=HEAD(scope); var!=NIL; var=TAIL(var), i++) {
+            if (HEAD(var) == TOS) {
+                index = i;
+                found = 1;
+            }
+        }
+        if (found && depth == 0 && c->flat) {
+            core_drop();
+            emit(c, OP_ARG, c->n_vars - index);
+            return;
+        } else if (found) {
+            if (c->flat) depth--;
+            if (depth > 0xff || index > 0xff) {
+                compile_error(c, "Too deeply nested variable");
+            }
+            core_drop();
+            emit(c, OP_LOCAL, (depth << 8) | index);
+            return;
+        }
+    }
+    emit_const(c, OP_GLOBAL);
+}
+
+static void compile_code(compiler *parent);
+
+// Whether expr contains the symbol lambda, i.e. may create a closure.
+static int contains_lambda(obj *expr) {
+    for (; obj_type(expr) == TYPE_CONS; expr=TAIL(expr)) {
+        if (HEAD(expr) == SYM_LAMBDA || contains_lambda(HEAD(expr)))
+            return 1;
+    }
+    return 0;
+}
+
+// The opcode for calling the builtin natfun named by symbol head with two
+// arguments, or OP_CALL.
+static int builtin_op(obj *head) {
+    if (obj_type(head) != TYPE_SYMBOL) return OP_CALL;
+    const char *name = ((native_symbol*)obj_binary_ptr(head))->x;
+    if (!strcmp(name, "+")) return OP_ADD;
+    if (!strcmp(name, "=")) return OP_EQ;
+    if (!strcmp(name, "<")) return OP_LT;
+    return OP_CALL;
+}
+
+// The length of list l, or -1 if it is not a proper list.
+static ptrdiff_t form_length(obj *l) {
+    ptrdiff_t n = 0;
+    for (; obj_type(l) == TYPE_CONS; l=TAIL(l)) n++;
+    return (l == NIL)? n : -1;
+}
+
+// ( expr -- )
+// If tail is non-zero, the code returns the value of expr from the current
+// frame, otherwise the value is pushed.
+static void compile_expr(compiler *c, int tail) {
+    native_type type = obj_type(TOS);
+    if (type == TYPE_SYMBOL) {
+        emit_variable(c);
+        emit_return(c, tail);
+        return;
+    } else if (type != TYPE_CONS) {
+        emit_const(c, OP_CONST);
+        emit_return(c, tail);
+        return;
+    }
+
+    obj *head = HEAD(TOS);
+    const ptrdiff_t n_args = form_length(TOS) - 1;
+    if (n_args < 0) {
+        compile_error(c, "Malformed expression");
+    }
+    if (head == SYM_QUOTE) {
+        if (n_args != 1) compile_error(c, "Malformed quote");
+        core_tail();
+        core_head();
+        emit_const(c, OP_CONST);
+        emit_return(c, tail);
+    } else if (head == SYM_LAMBDA) {
+        if (n_args != 2) compile_error(c, "Malformed lambda");
+                                // lambda::vars::body::nil
+        core_tail();            // vars::body::nil
+        core_dup();
+        core_head();            // vars::body::nil vars
+        core_swap();
+        core_tail();
+        core_head();            // vars body
+        compile_code(c);        // code
+        emit_const(c, OP_CLOSURE);
+        emit_return(c, tail);
+    } else if (head == SYM_DEFINE) {
+        if (n_args != 2 || obj_type(HEAD(TAIL(TOS))) != TYPE_SYMBOL) {
+            compile_error(c, "Malformed define");
+        }
+                                // define::var::exp::nil
+        core_tail();            // var::exp::nil
+        core_dup();
+        core_tail();
+        core_head();            // var::exp::nil exp
+        compile_expr(c, 0);
+        core_head();            // var
+        emit_const(c, OP_DEFINE);
+        emit_return(c, tail);
+    } else if (head == SYM_IF) {
+        if (n_args != 2 && n_args != 3) compile_error(c, "Malformed if");
+                                // if::cond::then::else::nil
+        core_tail();            // cond::then::else::nil
+        core_dup();
+        core_head();
+        compile_expr(c, 0);
+        size_t jump_else = emit(c, OP_JUMPF, 0);
+        core_tail();            // then::else::nil
+        core_dup();
+        core_head();
+        compile_expr(c, tail);
+        size_t jump_end = tail? 0 : emit(c, OP_JUMP, 0);
+        patch(c, jump_else);
+        core_tail();            // else::nil
+        if (TOS == NIL) {
+            emit_const(c, OP_CONST);
+            emit_return(c, tail);
+        } else {
+            core_head();
+            compile_expr(c, tail);
+        }
+        if (! tail) patch(c, jump_end);
+    } else {
+        size_t n = 0;           // fun::args
+        push(TAIL(TOS));        // fun::args args
+        while (TOS != NIL) {
+            core_dup();
+            core_head();
+            compile_expr(c, 0);
+            core_tail();
+            n++;
+        }
+        core_drop();
+        core_head();            // fun
+        const int op = (n == 2)? builtin_op(TOS) : OP_CALL;
+        compile_expr(c, 0);
+        if (op != OP_CALL) {
+            emit(c, op, tail);
+        } else {
+            emit(c, tail? OP_TAILCALL : OP_CALL, n);
+        }
+    }
+}
+
+// ( vars body -- code )
+// Compile a lambda body, or a top-level expression if parent is NULL.
+static void compile_code(compiler *parent) {
+    size_t n_vars = 0, i;
+    obj *var;
+    for (var=NOS; obj_type(var) == TYPE_CONS; var=TAIL(var)) {
+        if (obj_type(HEAD(var)) != TYPE_SYMBOL) break;
+        n_vars++;
+    }
+    if (var != NIL) {
+        compile_error(parent, "Malformed variable list");
+    }
+    if (n_vars > 0x100) {
+        compile_error(parent, "Too many arguments");
+    }
+    compiler c;
+    c.parent = parent;
+    c.size = 0x40;
+    c.x = malloc(c.size);
+    c.len = 0;
+    c.n_vars = n_vars;
+    c.flat = parent && !contains_lambda(TOS);
+    if (parent) {
+        push(NOS);
+        push(vm->stack[parent->scope]);
+        core_cons();
+        c.depth = parent->depth + 1;
+    } else {
+        push(NIL);
+        c.depth = 0;
+    }
+    c.scope = vm->sptr;
+    push(NIL);
+    c.consts = vm->sptr;
+    c.n_consts = 0;             // vars body scope consts
+    push(PICK(2));
+    compile_expr(&c, 1);
+
+    obj *o = new_obj(TYPE_CODE, 3 + 3*c.n_consts, sizeof(native_code) + c.len);
+    native_code *data = obj_binary_ptr(o);
+    data->n_vars = n_vars;
+    data->depth = c.depth;
+    data->prof_id = 0;
+    data->flat = c.flat;
+    memcpy(data->x, c.x, c.len);
+    free(c.x);
+    CODE_VARS(o) = PICK(3);
+    CODE_BODY(o) = PICK(2);
+    CODE_NAME(o) = NIL;
+    for (var=TOS, i=c.n_consts; var!=NIL; var=TAIL(var)) {
+        CODE_CONST(o, --i) = HEAD(var);
+        CODE_CACHE(o, i) = NIL;
+        CODE_VERSION(o, i) = NIL;
+    }
+    core_drop();
+    core_drop();
+    core_drop();
+    TOS = o;
+}
+
+// ( arg1 ... argn lambda -- frame code ) or ( -- arg1 ... argm lambda )
+// Set up the stack frame for calling lambda (see core_run()), and return its
+// frame pointer. The arguments are copied to a new frame in the slot of the
+// first argument, or, for flat code, stay on the stack as the m variables
+// of the lambda. Missing arguments are nil, extra arguments are ignored.
+static size_t core_bind(size_t n) {
+    const size_t base = vm->sptr + n;
+    const size_t n_vars = CODE_N_VARS(LAMBDA_CODE(TOS));
+    obj *o;
+    size_t i;
+    if (CODE_FLAT(LAMBDA_CODE(TOS))) {
+        if (n > n_vars) {
+            vm->stack[vm->sptr + n - n_vars] = TOS;
+            vm->sptr += n - n_vars;
+            stack_popped();
+        }
+        for (; n < n_vars; n++) {
+            push(TOS);
+            NOS = NIL;
+        }
+        return vm->sptr;
+    }
+    // Frames of up to three arguments are small.
+    switch (n_vars) {
+        case 0:  o = new_small(TYPE_FRAME, 1, 0); break;
+        case 1:  o = new_small(TYPE_FRAME, 2, 0); break;
+        case 2:  o = new_small(TYPE_FRAME, 3, 0); break;
+        case 3:  o = new_small(TYPE_FRAME, 4, 0); break;
+        default: o = new_obj(TYPE_FRAME, 1 + n_vars, 0);
+    }
+    FRAME_PARENT(o) = LAMBDA_ENV(TOS);
+    for (i=0; i<n_vars; i++)
+        FRAME_ARG(o, i) = (i < n)? PICK(n-i) : NIL;
+    obj *code = LAMBDA_CODE(TOS);
+    if (n == 0) push(NIL);
+    vm->stack[base] = o;
+    vm->stack[base-1] = code;
+    vm->sptr = base-1;
+    stack_popped();
+    return base;
+}
+
+// ( x y fun -- result ) or ( x y fun -- x y fun )
+// Do the call of OP_ADD, OP_EQ or OP_LT if fun is the builtin natfun of op
+// and the result needs no allocation, and return whether it was done.
+static inline int call_builtin(int op) {
+    const natfun f = NATFUN_FUN(TOS);
+    obj *x = NNOS, *y = NOS, *result;
+    if (op == OP_EQ && f == core_eq) {
+        // Immediate values are only equal to themselves.
+        result = new_bool(x == y ||
+                          (gc_is_ref(x) && gc_is_ref(y) && obj_equal(x, y)));
+    } else if (!obj_is_fixnum(x) || !obj_is_fixnum(y)) {
+        return 0;
+    } else if (op == OP_LT && f == core_lt) {
+        result = new_bool(fixnum_value(x) < fixnum_value(y));
+    } else if (op == OP_ADD && f == core_plus) {
+        const int64_t sum = fixnum_value(x) + fixnum_value(y);
+        if (sum < FIXNUM_MIN || sum > FIXNUM_MAX) return 0;
+        result = make_fixnum(sum);
+    } else {
+        return 0;
+    }
+    vm->stack[vm->sptr + 2] = result;
+    vm->sptr += 2;
+    stack_popped();
+    return 1;
+}
+
+// The code run by the stack frame at fp.
+static inline obj *frame_code(size_t fp) {
+    obj *frame = vm->stack[fp];
+    return (obj_type(frame) == TYPE_LAMBDA)?
+        LAMBDA_CODE(frame) : vm->stack[fp-1];
+}
+
+// A saved frame pointer of MEMO_FRAME on the return stack marks a memo
+// frame: a call of a memoized lambda, whose result is added to the cache
+// when the lambda returns. The hash of the arguments is saved below it, and
+// the memoized function and the key are on the value stack below the stack
+// frame of the lambda (see memo_enter()).
+#define MEMO_FRAME  ((size_t)-1)
+
+// ( env code -- result ) or ( arg1 ... argn lambda -- result )
+// Run compiled code in the given environment, or a lambda of flat code with
+// its arguments. The stack frame of the code consists of the environment or
+// argument frame at stack[fp] and code at stack[fp-1], or of the arguments
+// and the lambda at stack[fp] for flat code. The result is returned in the
+// slot of the first argument of flat code (BASE()), and in the slot of the
+// frame otherwise. The program counter and frame pointer of the caller is
+// saved on the return stack.
+static void core_run(void) {
+    const size_t entry = vm->rptr;
+    size_t fp = (obj_type(TOS) == TYPE_LAMBDA)? vm->sptr : vm->sptr + 1;
+    size_t pc = 0;
+    obj *code;
+    const native_code *data;    // the binary data of code
+    const uint8_t *x;
+
+#define CONST(i)    CODE_CONST(code, i)
+#define RELOAD()    (code = frame_code(fp), data = obj_binary_ptr(code), \
+                     x = data->x)
+#define BASE()      (data->flat? fp + data->n_vars : fp)
+#define FRAME()     (data->flat? LAMBDA_ENV(vm->stack[fp]) : vm->stack[fp])
+
+    // Every instruction jumps to the next one through this table (labels
+    // as values are a GCC extension), which the processor predicts better
+    // than the single jump of a switch. Any byte is a valid index.
+    static const void *const ops[256] = {
+        [0 ... 255]     = &&op_invalid,
+        [OP_CONST]      = &&op_const,
+        [OP_LOCAL]      = &&op_local,
+        [OP_ARG]        = &&op_arg,
+        [OP_GLOBAL]     = &&op_global,
+        [OP_CLOSURE]    = &&op_closure,
+        [OP_DEFINE]     = &&op_define,
+        [OP_JUMP]       = &&op_jump,
+        [OP_JUMPF]      = &&op_jumpf,
+        [OP_CALL]       = &&op_call,
+        [OP_TAILCALL]   = &&op_call,
+        [OP_RETURN]     = &&op_return,
+        [OP_ADD]        = &&op_builtin,
+        [OP_EQ]         = &&op_builtin,
+        [OP_LT]         = &&op_builtin
+    };
+    int op;
+    size_t arg;
+
+#define NEXT()      do { \
+        op = x[pc]; \
+        arg = x[pc+1] | (x[pc+2] << 8); \
+        pc += OP_SIZE; \
+        goto *ops[op]; \
+    } while (0)
+
+    RELOAD();
+    if (profiling) prof_enter_code(code);
+    NEXT();
+
+    op_const:
+        push(CONST(arg));
+        NEXT();
+    op_local: {
+        obj *frame = FRAME();
+        size_t depth;
+        for (depth=arg>>8; depth; depth--)
+            frame = FRAME_PARENT(frame);
+        push(FRAME_ARG(frame, arg & 0xff));
+        NEXT();
+    }
+    op_arg:
+        push(vm->stack[fp + arg]);
+        NEXT();
+    op_global: {
+        // The environment a code object looks up globals in never changes,
+        // so the value found stays valid until the next define.
+        obj *version = make_fixnum(vm->env_version);
+        if (CODE_VERSION(code, arg) == version) {
+            push(CODE_CACHE(code, arg));
+            NEXT();
+        }
+        obj *env = FRAME();
+        size_t depth;
+        for (depth=data->depth-data->flat; depth; depth--)
+            env = FRAME_PARENT(env);
+        push(env);
+        push(CONST(arg));
+        core_lookup();
+        if (pop() == FALSE) {
+            if (!pool_import(CONST(arg))) {
+                lisp_error("Unknown symbol: \"%s\"",
+                    ((native_symbol*)obj_binary_ptr(CONST(arg)))->x);
+            }
+            RELOAD();
+            version = make_fixnum(vm->env_version);
+        }
+        CODE_CACHE(code, arg) = TOS;
+        CODE_VERSION(code, arg) = version;
+        gc_write(&vm->heap, code);
+        NEXT();
+    }
+    op_closure:
+        push(CONST(arg));
+        push(vm->stack[fp]);
+        core_lambda();
+        RELOAD();
+        NEXT();
+    op_define:
+        if (obj_type(TOS) == TYPE_LAMBDA &&
+            CODE_NAME(LAMBDA_CODE(TOS)) == NIL)
+        {
+            CODE_NAME(LAMBDA_CODE(TOS)) = CONST(arg);
+            gc_write(&vm->heap, LAMBDA_CODE(TOS));
+        }
+        push(GLOBAL);
+        core_swap();
+        push(CONST(arg));
+        core_swap();            // global var x
+        core_define();
+        GLOBAL = TOS;
+        TOS = NIL;
+        RELOAD();
+        NEXT();
+    op_jump:
+        pc = arg;
+        NEXT();
+    op_jumpf:
+        obj_assert_type(TOS, TYPE_BOOL);
+        if (pop() == FALSE) pc = arg;
+        NEXT();
+    op_builtin:
+        // The profiler counts every call of a natfun.
+        if (!profiling && obj_type(TOS) == TYPE_NATFUN &&
+            call_builtin(op))
+        {
+            if (arg) goto op_return;
+            NEXT();
+        }
+        op = arg? OP_TAILCALL : OP_CALL;
+        arg = 2;
+        // fall through
+    op_call: {
+        const native_type type = obj_type(TOS);
+        if (type == TYPE_NATFUN) {
+            size_t base = vm->sptr + arg;
+            // Code only moves when the heap is collected.
+            const size_t collections = vm->heap.n_minor + vm->heap.n_major;
+            const natfun f = NATFUN_FUN(TOS);
+            if (profiling) prof_enter_natfun(TOS);
+            pop();
+            f();
+            if (profiling) prof_leave();
+            vm->stack[base] = TOS;
+            vm->sptr = base;
+            stack_popped();
+            if (vm->heap.n_minor + vm->heap.n_major != collections) RELOAD();
+            if (op == OP_TAILCALL) goto op_return;
+        } else if (type == TYPE_MEMO &&
+                   obj_type(MEMO_FUN(TOS)) != TYPE_LAMBDA) {
+            memo_call(arg);
+            RELOAD();
+            if (op == OP_TAILCALL) goto op_return;
+        } else if (type == TYPE_MEMO) {
+            // The lambda is called from a memo frame, which adds its result
+            // to the cache when it returns.
+            const uint32_t hash = memo_hash(arg);
+            if (memo_enter(arg, hash)) {
+                RELOAD();
+                if (op == OP_TAILCALL) goto op_return;
+                NEXT();
+            }
+            RELOAD();
+            // memo key arg1 ... argn lambda
+            if (op == OP_CALL) {
+                rpush(pc);
+                rpush(fp);
+            } else {
+                // Replace the frame of the caller.
+                const size_t d = BASE() - (vm->sptr + arg + 2);
+                memmove(vm->stack + vm->sptr + d,
+                        vm->stack + vm->sptr, (arg + 3)*sizeof(obj*));
+                vm->sptr += d;
+                stack_changed(vm->sptr + arg + 3);
+                if (profiling) prof_leave();
+            }
+            rpush(hash);
+            rpush(MEMO_FRAME);
+            fp = core_bind(arg);
+            goto call_lambda;
+        } else if (type == TYPE_LAMBDA) {
+            const native_code *callee = obj_binary_ptr(LAMBDA_CODE(TOS));
+            if (op == OP_CALL) {
+                rpush(pc);
+                rpush(fp);
+                // Flat code called with all its arguments needs no setup.
+                fp = (callee->flat && callee->n_vars == arg)?
+                    vm->sptr : core_bind(arg);
+            } else if (callee->flat && callee->n_vars == arg) {
+                // Replace the frame of the caller, moving the arguments and
+                // the lambda up to its result slot.
+                const size_t d = BASE() - (vm->sptr + arg);
+                size_t i;
+                for (i=arg+1; i>0; i--)
+                    vm->stack[vm->sptr + d + i-1] = vm->stack[vm->sptr + i-1];
+                vm->sptr += d;
+                stack_changed(vm->sptr + arg + 1);
+                fp = vm->sptr;
+                if (profiling) prof_leave();
+            } else {
+                // The same for any other stack frame.
+                const size_t base = BASE();
+                fp = core_bind(arg);
+                RELOAD();
+                const size_t top = BASE();
+                memmove(vm->stack + vm->sptr + base - top,
+                        vm->stack + vm->sptr,
+                        (top - vm->sptr + 1)*sizeof(obj*));
+                vm->sptr += base - top;
+                fp += base - top;
+                stack_changed(base + 1);
+                if (profiling) prof_leave();
+            }
+        call_lambda:
+            pc = 0;
+            RELOAD();
+            if (profiling) prof_enter_code(code);
+        } else {
+            lisp_error("Trying to evaluate type %d", type);
+        }
+        NEXT();
+    }
+    op_return:
+        fp = BASE();
+        vm->stack[fp] = TOS;
+        vm->sptr = fp;
+        stack_popped();
+        if (profiling) prof_leave();
+        while (vm->rptr != entry && RTOS == MEMO_FRAME) {
+            rpop();
+            memo_leave(rpop());
+        }
+        if (vm->rptr == entry) return;
+        fp = rpop();
+        pc = rpop();
+        RELOAD();
+        NEXT();
+    op_invalid:
+        lisp_error("Invalid opcode %d", op);
+
+#undef CONST
+#undef RELOAD
+#undef BASE
+#undef FRAME
+#undef NEXT
+}
+
+// ( arg1 ... argn f -- result )
+// Call the natfun, memoized function or lambda f with n arguments.
+static void core_apply(size_t n) {
+    const size_t base = vm->sptr + n;
+    if (obj_type(TOS) == TYPE_NATFUN) {
+        if (profiling) prof_enter_natfun(TOS);
+        core_execute();
+        if (profiling) prof_leave();
+    } else if (obj_type(TOS) == TYPE_MEMO) {
+        memo_call(n);
+    } else if (obj_type(TOS) == TYPE_LAMBDA) {
+        core_bind(n);
+        core_run();
+    } else {
+        lisp_error("Trying to evaluate type %d", obj_type(TOS));
+    }
+    vm->stack[base] = TOS;
+    vm->sptr = base;
+    stack_popped();
+}
+
+// ( thunk handler -- result )
+// Call thunk without arguments. If it raises an error, the stacks are cut
+// back to where they were, and the result is that of calling handler with
+// the error message.
+static void core_catch(void) {
+    catch_frame c;
+    c.prev = vm->catcher;
+    c.sptr = vm->sptr;
+    c.rptr = vm->rptr;
+    c.prof_depth = prof_depth;
+    if (setjmp(c.env)) {
+        vm->catcher = c.prev;
+        vm->sptr = c.sptr;
+        stack_popped();
+        vm->rptr = c.rptr;
+        while (profiling && prof_depth > c.prof_depth) prof_leave();
+        push(new_string_len(c.message, strlen(c.message)));
+        core_swap();            // thunk message handler
+        core_apply(1);
+        core_nip();
+        return;
+    }
+    vm->catcher = &c;
+    push(NOS);
+    core_apply(0);              // thunk handler result
+    vm->catcher = c.prev;
+    NNOS = TOS;
+    core_drop();
+    core_drop();
+}
+
+#endif
+